@@ -22,19 +22,35 @@
 #include <dev/ioapic.h>
 #include <dev/pci.h>
 #include <dev/e100.h>
+#if LAB >= 9
+#include <dev/virtio.h>
+#endif
 
 
 bool e100_present;
 uint8_t e100_irq;
+int e100_txslots;	// Transmit ring size, or 0 to size it at attach
+int e100_rxslots;	// Receive ring size, likewise
+#if LAB >= 9
+volatile bool e100_polling;	// Card's interrupts masked; e100_poll() busy
+static bool e100_rxbusy;	// Some CPU is draining the RX ring
+#endif
 
-#define E100_TX_SLOTS			64
+#define E100_TX_SLOTS			64	// Smallest rings we'll use
 #define E100_RX_SLOTS			64
+#define E100_MAXSLOTS			1024	// Largest
+#define E100_SLOTMEM			512	// Give rings 1/512 of memory
+#if LAB >= 9
+#define E100_RX_BUDGET			16	// Max frames to take per poll
+#define E100_TX_INTRGAP			8	// Frames per TX-done interrupt
+#endif
 
 #define E100_NULL			0xffffffff
 #define E100_SIZE_MASK			0x3fff	// mask out status/control bits
 
 #define	E100_CSR_SCB_STATACK		0x01	// scb_statack (1 byte)
 #define	E100_CSR_SCB_COMMAND		0x02	// scb_command (1 byte)
+#define	E100_CSR_SCB_INTCTL		0x03	// scb interrupt control (1 byte)
 #define	E100_CSR_SCB_GENERAL		0x04	// scb_general (4 bytes)
 #define	E100_CSR_PORT			0x08	// port (4 bytes)
 #define E100_CSR_EEPROM			0x0e	// EEPROM control reg (1 byte)
@@ -52,6 +68,8 @@ uint8_t e100_irq;
 #define E100_SCB_STATACK_FR		0x40
 #define E100_SCB_STATACK_CXTNO		0x80
 
+#define E100_SCB_INTCTL_M		0x01	// mask all interrupts
+
 // commands
 #define E100_CB_COMMAND_XMIT		0x4
 
@@ -117,7 +135,13 @@ struct e100_rbd {
 struct e100_tx_slot {
 	struct e100_cb_tx tcb;	// Transmit command block
 	struct e100_tbd tbd;	// Transmit buffer descriptor
+#if LAB >= 9
+	struct e100_tbd tbd2;	// Body for e100_txz(), or the "Extended TBD"
+				// that some cards require after the first
+	pageinfo *hold[2];	// Pages e100_txz() is sending from
+#else
 	struct e100_tbd unused;	// Some cards require a second "Extended TBD"
+#endif
 	char buf[NET_MAXPKT];	// Buffer
 };
 
@@ -130,12 +154,18 @@ static struct {
 	spinlock lock;
 	uint32_t iobase;
 
-	struct e100_tx_slot tx[E100_TX_SLOTS];
+	struct e100_tx_slot *tx[E100_MAXSLOTS];	// Each in half a page
+	int ntx;	// Transmit ring size
 	int tx_head;	// Next slot we'll use to enqueue a tx packet
 	int tx_tail;	// Next slot e100 should transmit and mark complete
 	char tx_idle;
+#if LAB >= 9
+	int tx_nointr;	// Packets queued since we last asked for an interrupt
+	bool tx_stalled; // We turned a packet away for want of a slot
+#endif
 
-	struct e100_rx_slot rx[E100_RX_SLOTS];
+	struct e100_rx_slot *rx[E100_MAXSLOTS];
+	int nrx;	// Receive ring size
 	int rx_head;	// Next slot e100 should receive into and mark complete
 	int rx_tail;	// Last slot e100 can use before it must suspend
 	char rx_idle;
@@ -177,7 +207,7 @@ static void e100_tx_start(void)
 {
 	assert(spinlock_holding(&e100.lock));
 
-	int i = e100.tx_tail % E100_TX_SLOTS;
+	int i = e100.tx_tail % e100.ntx;
 
 	if (e100.tx_tail == e100.tx_head)
 		panic("oops, no TCBs");
@@ -185,7 +215,7 @@ static void e100_tx_start(void)
 	if (e100.tx_idle) {
 		e100_scb_wait();
 		outl(e100.iobase + E100_CSR_SCB_GENERAL, 
-		     mem_phys(&e100.tx[i].tcb));
+		     mem_phys(&e100.tx[i]->tcb));
 		e100_scb_cmd(E100_SCB_COMMAND_CU_START);
 		e100.tx_idle = 0;
 	} else {
@@ -194,6 +224,37 @@ static void e100_tx_start(void)
 	}
 }
 
+#if LAB >= 9
+static void e100_intr_tx(void);
+
+// Hand the transmit command in slot i, already filled in, to the card.
+// Only the newest command carries the suspend bit, so the card runs
+// through a burst of queued packets without stopping after each one;
+// and only every E100_TX_INTRGAP'th asks for an interrupt when done,
+// since anything that transmits reclaims completed slots anyway.
+static void e100_tx_queue(int i)
+{
+	assert(spinlock_holding(&e100.lock));
+
+	uint16_t cmd = E100_CB_COMMAND_XMIT | E100_CB_COMMAND_SF
+			| E100_CB_COMMAND_S;
+	if (++e100.tx_nointr >= E100_TX_INTRGAP ||
+	    e100.tx_head - e100.tx_tail >= e100.ntx - E100_TX_INTRGAP) {
+		cmd |= E100_CB_COMMAND_I;
+		e100.tx_nointr = 0;
+	}
+	e100.tx[i]->tcb.cb_status = 0;
+	e100.tx[i]->tcb.cb_command = cmd;
+	if (e100.tx_head != e100.tx_tail) {	// let the card run on into it
+		int j = (e100.tx_head - 1) % e100.ntx;
+		e100.tx[j]->tcb.cb_command &= ~E100_CB_COMMAND_S;
+	}
+	e100.tx_head++;
+
+	e100_tx_start();
+}
+#endif
+
 int e100_tx(void *hdr, int hlen, void *body, int blen)
 {
 	assert(hlen + blen <= NET_MAXPKT);
@@ -203,17 +264,25 @@ int e100_tx(void *hdr, int hlen, void *body, int blen)
 
 	spinlock_acquire(&e100.lock);
 
-	if (e100.tx_head - e100.tx_tail == E100_TX_SLOTS) {
+#if LAB >= 9
+	if (e100.tx_head - e100.tx_tail == e100.ntx)
+		e100_intr_tx();		// reclaim slots sent without interrupt
+#endif
+	if (e100.tx_head - e100.tx_tail == e100.ntx) {
+#if LAB >= 9
+		e100.tx_stalled = 1;	// net_txready() when there's room
+#else
 		warn("e100_tx: no transmit buffers");
+#endif
 		spinlock_release(&e100.lock);
 		return 0;
 	}
 
-	i = e100.tx_head % E100_TX_SLOTS;
+	i = e100.tx_head % e100.ntx;
 
 	// Copy the packet header and body into the transmit buffer
-	memcpy(e100.tx[i].buf, hdr, hlen);
-	memcpy(e100.tx[i].buf+hlen, body, blen);
+	memcpy(e100.tx[i]->buf, hdr, hlen);
+	memcpy(e100.tx[i]->buf+hlen, body, blen);
 
 	// Compute the total packet length,
 	// accounting for Ethernet's 64-byte minimum.
@@ -221,31 +290,107 @@ int e100_tx(void *hdr, int hlen, void *body, int blen)
 	int len = MAX(hlen + blen, 64);
 
 	// Set up the transmit command block
-	e100.tx[i].tbd.tb_addr = mem_phys(e100.tx[i].buf);
-	e100.tx[i].tbd.tb_size = len;
-	e100.tx[i].tcb.cb_status = 0;
-	e100.tx[i].tcb.cb_command = E100_CB_COMMAND_XMIT
+	e100.tx[i]->tbd.tb_addr = mem_phys(e100.tx[i]->buf);
+	e100.tx[i]->tbd.tb_size = len;
+#if LAB >= 9
+	e100.tx[i]->tbd2.tb_addr = 0;
+	e100.tx[i]->tbd2.tb_size = 0;
+	e100.tx[i]->tcb.tbd_number = 1;
+	e100_tx_queue(i);
+#else
+	e100.tx[i]->tcb.cb_status = 0;
+	e100.tx[i]->tcb.cb_command = E100_CB_COMMAND_XMIT
 		| E100_CB_COMMAND_SF | E100_CB_COMMAND_I | E100_CB_COMMAND_S;
 	e100.tx_head++;
 
 	e100_tx_start();
+#endif
+
+	spinlock_release(&e100.lock);
+	return 1;
+}
+
+#if LAB >= 9
+// Take a reference on the page holding buf for the card's use,
+// or return NULL if buf isn't in a single allocated page.
+static pageinfo *
+e100_hold(void *buf, int len)
+{
+	if (ROUNDDOWN(mem_phys(buf), PAGESIZE)
+			!= ROUNDDOWN(mem_phys(buf) + len - 1, PAGESIZE))
+		return NULL;
+	pageinfo *pi = mem_ptr2pi(buf);
+	if (pi <= &mem_pageinfo[0] || pi >= &mem_pageinfo[mem_npage]
+			|| pi->refcount == 0)
+		return NULL;
+	mem_incref(pi);
+	return pi;
+}
+
+// Transmit a packet without copying it:
+// the card fetches hdr and body straight from memory,
+// one transmit buffer descriptor each.
+// Each buffer must lie within a page from mem_alloc() that its owner
+// holds a reference to; we take references of our own
+// until the card has sent the packet, so the owner may let go any time.
+// Falls back to copying packets too short to need no padding
+// or buffers we can't hold.
+int e100_txz(void *hdr, int hlen, void *body, int blen)
+{
+	assert(hlen + blen <= NET_MAXPKT);
+	int i;
+
+	if (hlen + blen < 64)
+		return e100_tx(hdr, hlen, body, blen);
+	pageinfo *hpi = e100_hold(hdr, hlen), *bpi = NULL;
+	if (hpi == NULL || (blen > 0 && (bpi = e100_hold(body, blen)) == NULL)) {
+		if (hpi != NULL)
+			mem_decref(hpi, mem_free);
+		return e100_tx(hdr, hlen, body, blen);
+	}
+
+	spinlock_acquire(&e100.lock);
+
+	if (e100.tx_head - e100.tx_tail == e100.ntx)
+		e100_intr_tx();
+	if (e100.tx_head - e100.tx_tail == e100.ntx) {
+		e100.tx_stalled = 1;
+		spinlock_release(&e100.lock);
+		mem_decref(hpi, mem_free);
+		if (bpi != NULL)
+			mem_decref(bpi, mem_free);
+		return 0;
+	}
+
+	i = e100.tx_head % e100.ntx;
+	assert(e100.tx[i]->hold[0] == NULL && e100.tx[i]->hold[1] == NULL);
+	e100.tx[i]->hold[0] = hpi;
+	e100.tx[i]->hold[1] = bpi;
+
+	e100.tx[i]->tbd.tb_addr = mem_phys(hdr);
+	e100.tx[i]->tbd.tb_size = hlen;
+	e100.tx[i]->tbd2.tb_addr = blen > 0 ? mem_phys(body) : 0;
+	e100.tx[i]->tbd2.tb_size = blen;
+	e100.tx[i]->tcb.tbd_number = blen > 0 ? 2 : 1;
+	e100_tx_queue(i);
 
 	spinlock_release(&e100.lock);
 	return 1;
 }
+#endif	// LAB >= 9
 
 static void e100_rx_start(void)
 {
 	assert(spinlock_holding(&e100.lock));
 
-	int i = e100.rx_head % E100_RX_SLOTS;
-	if (e100.rx[i].rfd.status & E100_RFA_STATUS_C)
+	int i = e100.rx_head % e100.nrx;
+	if (e100.rx[i]->rfd.status & E100_RFA_STATUS_C)
 		return;		// We haven't finished processing this RFD.
 
 	if (e100.rx_idle) {
 		e100_scb_wait();
 		outl(e100.iobase + E100_CSR_SCB_GENERAL, 
-		     mem_phys(&e100.rx[i].rfd));
+		     mem_phys(&e100.rx[i]->rfd));
 		e100_scb_cmd(E100_SCB_COMMAND_RU_START);
 		e100.rx_idle = 0;
 	} else {
@@ -260,12 +405,81 @@ static void e100_intr_tx(void)
 
 	// Bump tx_tail past all transmit commands that have completed
 	for (; e100.tx_head != e100.tx_tail; e100.tx_tail++) {
-		i = e100.tx_tail % E100_TX_SLOTS;
-		if (!(e100.tx[i].tcb.cb_status & E100_CB_STATUS_C))
+		i = e100.tx_tail % e100.ntx;
+		if (!(e100.tx[i]->tcb.cb_status & E100_CB_STATUS_C))
 			break;
+#if LAB >= 9
+		int j;
+		for (j = 0; j < 2; j++)		// done with e100_txz()'s pages
+			if (e100.tx[i]->hold[j] != NULL) {
+				mem_decref(e100.tx[i]->hold[j], mem_free);
+				e100.tx[i]->hold[j] = NULL;
+			}
+#endif
 	}
 }
 
+#if LAB >= 9
+// Dispatch up to budget received packets to the network stack,
+// and return true if more are waiting after that.
+// Releases and re-acquires the e100.lock just once for the whole batch.
+// Only one CPU drains the ring at a time, so that batches reach net_rx()
+// in the order the card received them; any other caller finds e100_rxbusy
+// set and just reports more waiting, leaving them to the owner or a poll.
+static bool e100_intr_rx(int budget)
+{
+	assert(spinlock_holding(&e100.lock));
+
+	if (e100_rxbusy)
+		return 1;
+	e100_rxbusy = 1;
+
+	int first = e100.rx_head;
+	int i, n;
+
+	// Claim a batch of filled RFDs, as below, one by one.
+	while (e100.rx_head - first < budget) {
+		i = e100.rx_head % e100.nrx;
+		if (!(e100.rx[i]->rfd.status & E100_RFA_STATUS_C))
+			break;
+		e100.rx_head++;
+	}
+	int last = e100.rx_head;
+
+	spinlock_release(&e100.lock);
+	for (n = first; n < last; n++) {
+		i = n % e100.nrx;
+		if (e100.rx[i]->rfd.status & E100_RFA_STATUS_OK) {
+			int len = e100.rx[i]->rfd.actual & E100_SIZE_MASK;
+			net_rx(e100.rx[i]->buf, len);
+		} else
+			warn("e100: packet receive error: %x",
+				e100.rx[i]->rfd.status);
+	}
+	spinlock_acquire(&e100.lock);
+
+	for (n = first; n < last; n++) {
+		i = n % e100.nrx;
+		assert(e100.rx[i]->rfd.status & E100_RFA_STATUS_C);
+		e100.rx[i]->rfd.control = E100_RFA_CONTROL_S;
+		e100.rx[i]->rfd.status = 0;
+		e100.rx[i]->rfd.actual = 0;
+	}
+
+	// We own every claimed RFD, so the tail catches right up.
+	while (e100.rx_tail < e100.rx_head) {
+		i = e100.rx_tail % e100.nrx;
+		assert(e100.rx[i]->rfd.control == E100_RFA_CONTROL_S);
+		i = (e100.rx_tail + e100.nrx - 1) % e100.nrx;
+		e100.rx[i]->rfd.control = 0;	// Prev RFD need not suspend
+		e100.rx_tail++;
+	}
+	e100_rxbusy = 0;
+
+	i = e100.rx_head % e100.nrx;
+	return (e100.rx[i]->rfd.status & E100_RFA_STATUS_C) != 0;
+}
+#else	// LAB < 9
 static void e100_intr_rx(void)
 {
 	assert(spinlock_holding(&e100.lock));
@@ -280,8 +494,8 @@ static void e100_intr_rx(void)
 	// We use the RFD's E100_RFA_STATUS_C bit as a high-level "lock"
 	// on the RFD while the received packet is being processed.
 	while (1) {
-		i = e100.rx_head % E100_RX_SLOTS;
-		if (!(e100.rx[i].rfd.status & E100_RFA_STATUS_C))
+		i = e100.rx_head % e100.nrx;
+		if (!(e100.rx[i]->rfd.status & E100_RFA_STATUS_C))
 			break;	// No more un-processed packets received
 
 		// "Claim" this RFD by moving e100.rx_head past it,
@@ -291,38 +505,39 @@ static void e100_intr_rx(void)
 		e100.rx_head++;
 
 		// Dispatch the received packet to our network stack.
-		if (e100.rx[i].rfd.status & E100_RFA_STATUS_OK) {
+		if (e100.rx[i]->rfd.status & E100_RFA_STATUS_OK) {
 			spinlock_release(&e100.lock);
-			int len = e100.rx[i].rfd.actual & E100_SIZE_MASK;
-			net_rx(e100.rx[i].buf, len);
+			int len = e100.rx[i]->rfd.actual & E100_SIZE_MASK;
+			net_rx(e100.rx[i]->buf, len);
 			spinlock_acquire(&e100.lock);
 		} else
 			warn("e100: packet receive error: %x",
-				e100.rx[i].rfd.status);
-		assert(e100.rx[i].rfd.status & E100_RFA_STATUS_C);
+				e100.rx[i]->rfd.status);
+		assert(e100.rx[i]->rfd.status & E100_RFA_STATUS_C);
 
 		// Un-claim this RFD and get it ready to be filled again.
 		// Different RFDs might be un-claimed out of order
 		// due to concurrency among the CPUs.
 		// Mark all RFDs "suspend" until tail catches up.
-		e100.rx[i].rfd.control = E100_RFA_CONTROL_S;
-		e100.rx[i].rfd.status = 0;
-		e100.rx[i].rfd.actual = 0;
+		e100.rx[i]->rfd.control = E100_RFA_CONTROL_S;
+		e100.rx[i]->rfd.status = 0;
+		e100.rx[i]->rfd.actual = 0;
 	}
 
 	// Now move the tail forward to the first uncompleted RFD,
 	// clearing unnecessary "suspend" bits as we go.
 	while (e100.rx_tail < e100.rx_head) {
-		i = e100.rx_tail % E100_RX_SLOTS;
-		if (e100.rx[i].rfd.status & E100_RFA_STATUS_C)
+		i = e100.rx_tail % e100.nrx;
+		if (e100.rx[i]->rfd.status & E100_RFA_STATUS_C)
 			break;	// This RFD still being processed by some CPU
 
-		assert(e100.rx[i].rfd.control == E100_RFA_CONTROL_S);
-		i = (e100.rx_tail - 1) % E100_RX_SLOTS;
-		e100.rx[i].rfd.control = 0;	// Prev RFD need not suspend
+		assert(e100.rx[i]->rfd.control == E100_RFA_CONTROL_S);
+		i = (e100.rx_tail + e100.nrx - 1) % e100.nrx;
+		e100.rx[i]->rfd.control = 0;	// Prev RFD need not suspend
 		e100.rx_tail++;
 	}
 }
+#endif	// LAB < 9
 
 void e100_intr(void)
 {
@@ -336,6 +551,11 @@ void e100_intr(void)
 		r &= ~(E100_SCB_STATACK_CXTNO | E100_SCB_STATACK_CNA);
 		e100_intr_tx();
 	}
+#if LAB >= 9
+	bool ready = e100.tx_stalled && e100.tx_head - e100.tx_tail < e100.ntx;
+	if (ready)
+		e100.tx_stalled = 0;
+#endif
 	if (e100.tx_head > e100.tx_tail)
 		e100_tx_start();
 
@@ -347,16 +567,77 @@ void e100_intr(void)
 
 	if (r & E100_SCB_STATACK_FR) {
 		r &= ~E100_SCB_STATACK_FR;
+#if LAB >= 9
+		// Take one batch here; if the card has more for us,
+		// mask its interrupts and leave the rest to e100_poll().
+		if (!e100_polling && e100_intr_rx(E100_RX_BUDGET)) {
+			outb(e100.iobase + E100_CSR_SCB_INTCTL,
+				E100_SCB_INTCTL_M);
+			e100_polling = 1;
+		}
+#else
 		e100_intr_rx();	// releases and re-acquires e100.lock!
+#endif
 	}
 	e100_rx_start();
 
 	if (r)
 		warn("e100_intr: unhandled STAT/ACK %x\n", r);
 
+	spinlock_release(&e100.lock);
+#if LAB >= 9
+	if (ready)
+		net_txready();	// resume what we turned away
+#endif
+}
+
+#if LAB >= 9
+// Called from the clock tick and from idle CPUs:
+// reclaim transmit slots sent without an interrupt,
+// and while e100_intr() has left receiving to us, take another batch,
+// unmasking the card's interrupts once it runs dry.
+// A packet arriving just before we unmask still has its FR bit pending,
+// so it interrupts as soon as we do.
+void e100_poll(void)
+{
+	if (!e100_present)
+		return;
+
+	spinlock_acquire(&e100.lock);
+
+	e100_intr_tx();
+	if (e100.tx_head > e100.tx_tail)
+		e100_tx_start();
+
+	if (e100_polling) {
+		if (!e100_intr_rx(E100_RX_BUDGET) && e100_polling) {
+			e100_polling = 0;
+			outb(e100.iobase + E100_CSR_SCB_INTCTL, 0);
+		}
+		e100_rx_start();
+	}
+
 	spinlock_release(&e100.lock);
 }
 
+// How many more frames the card could receive before it runs out of
+// buffers, counting those received but not yet taken by the stack.
+// Unlocked, so only a hint, for net.c to advertise to its peers.
+int e100_rxroom(void)
+{
+	int head = e100.rx_head, tail = e100.rx_tail;
+	int n = head, i;
+
+	while (n - head < e100.nrx) {
+		i = n % e100.nrx;
+		if (!(e100.rx[i]->rfd.status & E100_RFA_STATUS_C))
+			break;
+		n++;
+	}
+	return MAX(e100.nrx - (n - tail), 0);
+}
+#endif	// LAB >= 9
+
 // Clock a serial opcode/address bit out to the EEPROM.
 int e100_eebit(bool bit)
 {
@@ -404,10 +685,53 @@ uint16_t e100_eeread(uint8_t addr)
 	return val;
 }
 
+// Pick a ring size: n if the user set one, else as large as
+// E100_SLOTMEM allows, and in any case a power of two within bounds.
+static int e100_ringsize(int n, int min)
+{
+	if (n == 0)
+		n = mem_npage / E100_SLOTMEM;
+	n = MIN(MAX(n, min), E100_MAXSLOTS);
+	while (n & (n - 1))
+		n &= n - 1;
+	return n;
+}
+
+// Carve ring slots of a given size out of freshly allocated pages,
+// as many to a page as fit without straddling a page boundary.
+static int e100_slotalloc(void **slot, int n, size_t size)
+{
+	int per = PAGESIZE / size, i;
+
+	for (i = 0; i < n; i++) {
+		if (i % per == 0) {
+			pageinfo *pi = mem_alloc();
+			if (pi == NULL)
+				return 0;
+			mem_incref(pi);
+			slot[i] = mem_pi2ptr(pi);
+		} else
+			slot[i] = (char*) slot[i-1] + size;
+	}
+	return 1;
+}
+
 int e100_attach(struct pci_func *pcif)
 {
 	int i, next;
 
+	e100.ntx = e100_ringsize(e100_txslots, E100_TX_SLOTS);
+	e100.nrx = e100_ringsize(e100_rxslots, E100_RX_SLOTS);
+	if (!e100_slotalloc((void**) e100.tx, e100.ntx, sizeof(*e100.tx[0]))
+	    || !e100_slotalloc((void**) e100.rx, e100.nrx,
+				sizeof(*e100.rx[0]))) {
+		warn("e100: no memory for %d+%d ring slots",
+			e100.ntx, e100.nrx);
+		return 0;
+	}
+	e100_txslots = e100.ntx;
+	e100_rxslots = e100.nrx;
+
 	pci_func_enable(pcif);
 
 	e100_irq = pcif->irq_line;
@@ -420,25 +744,25 @@ int e100_attach(struct pci_func *pcif)
 	udelay(10);
 
 	// Setup TX DMA ring for CU
-	for (i = 0; i < E100_TX_SLOTS; i++) {
-		next = (i + 1) % E100_TX_SLOTS;
-		memset(&e100.tx[i], 0, sizeof(e100.tx[i]));
-		e100.tx[i].tcb.link_addr = mem_phys(&e100.tx[next].tcb);
-		e100.tx[i].tcb.tbd_array_addr = mem_phys(&e100.tx[i].tbd);
-		e100.tx[i].tcb.tbd_number = 1;
-		e100.tx[i].tcb.tx_threshold = 4;
+	for (i = 0; i < e100.ntx; i++) {
+		next = (i + 1) % e100.ntx;
+		memset(e100.tx[i], 0, sizeof(*e100.tx[i]));
+		e100.tx[i]->tcb.link_addr = mem_phys(&e100.tx[next]->tcb);
+		e100.tx[i]->tcb.tbd_array_addr = mem_phys(&e100.tx[i]->tbd);
+		e100.tx[i]->tcb.tbd_number = 1;
+		e100.tx[i]->tcb.tx_threshold = 4;
 	}
 
 	// Setup RX DMA ring for RU
-	for (i = 0; i < E100_RX_SLOTS; i++) {
-		next = (i + 1) % E100_RX_SLOTS;
-		memset(&e100.rx[i], 0, sizeof(e100.rx[i]));
-		e100.rx[i].rfd.control = 0;
-		e100.rx[i].rfd.status = 0;
-		e100.rx[i].rfd.size = NET_MAXPKT;
-		e100.rx[i].rfd.link_addr = mem_phys(&e100.rx[next].rfd);
+	for (i = 0; i < e100.nrx; i++) {
+		next = (i + 1) % e100.nrx;
+		memset(e100.rx[i], 0, sizeof(*e100.rx[i]));
+		e100.rx[i]->rfd.control = 0;
+		e100.rx[i]->rfd.status = 0;
+		e100.rx[i]->rfd.size = NET_MAXPKT;
+		e100.rx[i]->rfd.link_addr = mem_phys(&e100.rx[next]->rfd);
 	}
-	e100.rx[E100_RX_SLOTS-1].rfd.control = E100_RFA_CONTROL_S;
+	e100.rx[e100.nrx-1]->rfd.control = E100_RFA_CONTROL_S;
 
 	// Determine the EEPROM's size (number of address bits)
 	outb(e100.iobase + E100_CSR_EEPROM, E100_EECS);	// activate
@@ -458,7 +782,10 @@ int e100_attach(struct pci_func *pcif)
 	cprintf("e100: MAC address");
 	for (i = 0; i < 6; i++)
 		cprintf("%c%02x", i ? ':' : ' ', e100.mac[i]);
-	cprintf("\n");
+	cprintf(", %d TX and %d RX slots\n", e100.ntx, e100.nrx);
+#if LAB >= 9
+	if (!virtio_present)	// the faster card gets to be us
+#endif
 	memcpy(net_mac, e100.mac, 6);
 
 	// Enable network card interrupts
@@ -16,10 +16,21 @@ struct pci_func;
 
 extern bool e100_present;
 extern uint8_t e100_irq;
+extern int e100_txslots, e100_rxslots;	// Ring sizes; 0 picks at boot
+#if LAB >= 9
+extern volatile bool e100_polling;
+#endif
 
 int  e100_attach(struct pci_func *pcif);
 int  e100_tx(void *hdr, int hlen, void *body, int blen);
+#if LAB >= 9
+int  e100_txz(void *hdr, int hlen, void *body, int blen);
+#endif
 void e100_intr(void);
+#if LAB >= 9
+void e100_poll(void);
+int  e100_rxroom(void);
+#endif
 
 #endif	// PIOS_KERN_E100_H
 #endif  // LAB >= 5
@@ -17,6 +17,9 @@
 
 #include <dev/pci.h>
 #include <dev/e100.h>
+#if LAB >= 9
+#include <dev/virtio.h>
+#endif
 
 
 // Flag to do "lspci" at bootup
@@ -44,6 +47,9 @@ struct pci_driver pci_attach_class[] = {
 struct pci_driver pci_attach_vendor[] = {
 #if LAB >= 5		// was SOL >= 5
 	{ 0x8086, 0x1209, &e100_attach },
+#endif
+#if LAB >= 9
+	{ 0x1af4, 0x1000, &virtio_attach },	// virtio-net, legacy
 #endif
 	{ 0, 0, 0 },
 };
@@ -4,8 +4,12 @@
 #include <inc/stdio.h>
 #include <inc/string.h>
 #include <inc/x86.h>
+#include <inc/trap.h>
 
 #include <kern/cpu.h>
+#include <kern/spinlock.h>
+
+#include <dev/lapic.h>
 
 
 // Intel model specific registers (MSRs) for performanc monitoring
@@ -27,6 +31,9 @@
 #define FIXED_CTR_EN_ALL	0x3	// Count events in all rings
 #define FIXED_CTR_PMI		0x8	// Enable interrupt on overflow
 
+// Fixed counter 0's enable/overflow bit in the global control registers
+#define GLOBAL_FIXED_CTR0	(1ULL << 32)
+
 
 
 // AMD MSRs for performance monitoring
@@ -55,14 +62,68 @@
 #define RetiredInstructions	0xc0		// Retired instructions event
 
 
+// We stop short of the target by the vendor's worst-case margin,
+// which we never shrink: an interrupt that arrived past the target
+// would have run instructions the quantum can't take back.
+// If an interrupt ever lands within PMC_SLOP of the margin,
+// the margin grows to twice that overshoot plus the slop.
+#define PMC_SLOP		8
+
 bool pmc_avail;		// true if PMC instruction counting is available
-int pmc_safety;		// safety margin required to account for overshoot
+volatile int pmc_safety;	// safety margin required to account for overshoot
 int pmc_overshoot;	// max overshoot we've observed so far
 int64_t pmc_ctrmask;	// mask of usable perf counter bits
 
+static spinlock pmc_lock;	// Protects pmc_safety and pmc_overshoot updates
+
 void (*pmc_set)(int64_t maxcnt);
 int64_t (*pmc_get)(int64_t maxcnt);
 
+// Record how far past its target a counter interrupt arrived,
+// and widen the safety margin if that came too close to it.
+void
+pmc_skid(int overshoot)
+{
+	spinlock_acquire(&pmc_lock);
+	if (overshoot > pmc_overshoot)
+		pmc_overshoot = overshoot;
+	if (overshoot + PMC_SLOP > pmc_safety) {
+		pmc_safety = overshoot * 2 + PMC_SLOP;
+		warn("pmc: overshoot %d; safety margin now %d",
+			overshoot, pmc_safety);
+	}
+	spinlock_release(&pmc_lock);
+}
+
+void
+pmc_intelset(int64_t maxcnt)
+{
+	wrmsr(IA32_FIXED_CTR_CTRL, FIXED_CTR_EN_NONE);
+	if (maxcnt == 0)
+		return;		// leave counter and interrupt disabled
+
+	// The local APIC masks the PMI vector each time it fires.
+	lapic[PCINT] = T_PERFCTR;
+
+	wrmsr(IA32_PERF_GLOBAL_OVF_CTRL, GLOBAL_FIXED_CTR0);
+	wrmsr(IA32_FIXED_CTR0, -maxcnt & pmc_ctrmask);
+	wrmsr(IA32_PERF_GLOBAL_CTRL, GLOBAL_FIXED_CTR0);
+	wrmsr(IA32_FIXED_CTR_CTRL, FIXED_CTR_EN_USER | FIXED_CTR_PMI);
+}
+
+int64_t
+pmc_intelget(int64_t maxcnt)
+{
+	int64_t init = -maxcnt & pmc_ctrmask;
+	int64_t ctr = rdmsr(IA32_FIXED_CTR0);
+	if (ctr < init)
+		ctr += pmc_ctrmask+1;	// must have wrapped
+
+	wrmsr(IA32_FIXED_CTR_CTRL, FIXED_CTR_EN_NONE);
+
+	return ctr - init;
+}
+
 void
 pmc_intelinit(void)
 {
@@ -77,6 +138,15 @@ pmc_intelinit(void)
 
 	cprintf("PMC ver %d npmc %d width %d nfix %d fixwidth %d\n",
 		ver, npmc, width, nfix, fixwidth);
+
+	// Fixed counter 0 counts INST_RETIRED.ANY from version 2 on.
+	if (ver >= 2 && nfix >= 1 && fixwidth > 0 && fixwidth < 64) {
+		pmc_ctrmask = (1LL << fixwidth) - 1;
+		pmc_avail = true;
+		pmc_set = pmc_intelset;
+		pmc_get = pmc_intelget;
+		pmc_safety = 128;
+	}
 #if 0
 	cprintf("raw %08x %08x %08x %08x\n",
 		inf.eax, inf.ebx, inf.edx, inf.ecx);
@@ -148,6 +218,7 @@ pmc_init(void)
 {
 	if (!cpu_onboot())
 		return;
+	spinlock_init(&pmc_lock);
 
 	cpuinfo inf;
 	cpuid(0, &inf);
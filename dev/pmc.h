@@ -10,13 +10,14 @@
 
 
 extern bool pmc_avail;	// true if PMC instruction counting is available
-extern int pmc_safety;	// safety margin required to account for overshoot
+extern volatile int pmc_safety; // safety margin required to account for overshoot
 extern int pmc_overshoot; // max overshoot we've observed so far
 extern void (*pmc_set)(int64_t maxcnt);
 extern int64_t (*pmc_get)(int64_t maxcnt);
 
 
 void pmc_init(void);
+void pmc_skid(int overshoot);
 
 #endif /* PIOS_KERN_PMC_H_ */
 #endif // LAB >= 9
@@ -0,0 +1,612 @@
+#if LAB >= 9
+// Driver for the virtio network device, legacy PCI interface.
+//
+// Under QEMU this moves frames by sharing rings of buffer descriptors
+// with the host directly, rather than emulating a real card's registers,
+// so it runs far faster than the e100.
+// With the device's multiqueue feature we use up to VIRTIO_MAXPAIRS
+// receive/transmit queue pairs: each peer node has its own transmit queue,
+// and the device spreads received frames across the receive queues.
+
+#include <inc/x86.h>
+#include <inc/stdio.h>
+#include <inc/string.h>
+#include <inc/assert.h>
+
+#include <kern/cpu.h>
+#include <kern/mem.h>
+#include <kern/spinlock.h>
+#include <kern/net.h>
+
+#include <dev/pic.h>
+#include <dev/ioapic.h>
+#include <dev/pci.h>
+#include <dev/virtio.h>
+
+
+bool virtio_present;
+uint8_t virtio_irq;
+volatile bool virtio_polling;
+
+#define VIRTIO_MAXPAIRS		4	// Max queue pairs we'll use
+#define VIRTIO_MAXQ		(2*VIRTIO_MAXPAIRS+1)	// ... plus control
+#define VIRTIO_QMAX		256	// Max descriptors per queue we handle
+#define VIRTIO_RINGPAGES	3	// Enough for a ring of VIRTIO_QMAX
+#define VIRTIO_RX_BUDGET	16	// Max frames to take per poll
+#define VIRTIO_BUFSIZE		2048	// Buffer per slot, two to a page
+#define VIRTIO_PKTOFF		16	// Where the frame starts in a buffer
+
+// Legacy PCI I/O space registers
+#define VIRTIO_PCI_HOSTFEAT	0x00	// Device features (4 bytes)
+#define VIRTIO_PCI_GUESTFEAT	0x04	// Features we accept (4 bytes)
+#define VIRTIO_PCI_QADDR	0x08	// Selected queue's page number (4)
+#define VIRTIO_PCI_QSIZE	0x0c	// Selected queue's size (2 bytes)
+#define VIRTIO_PCI_QSEL		0x0e	// Queue selector (2 bytes)
+#define VIRTIO_PCI_QNOTIFY	0x10	// Queue notifier (2 bytes)
+#define VIRTIO_PCI_STATUS	0x12	// Device status (1 byte)
+#define VIRTIO_PCI_ISR		0x13	// Interrupt status, read to ack (1)
+#define VIRTIO_PCI_CONFIG	0x14	// Device-specific configuration
+
+// Network device configuration, relative to VIRTIO_PCI_CONFIG
+#define VIRTIO_NET_CFG_MAC	0x00	// MAC address (6 bytes)
+#define VIRTIO_NET_CFG_MAXPAIRS	0x08	// Max queue pairs (2 bytes)
+
+#define VIRTIO_STATUS_ACK	0x01
+#define VIRTIO_STATUS_DRIVER	0x02
+#define VIRTIO_STATUS_DRIVER_OK	0x04
+#define VIRTIO_STATUS_FAILED	0x80
+
+#define VIRTIO_NET_F_MAC	(1 << 5)	// Device has a MAC address
+#define VIRTIO_NET_F_CTRL_VQ	(1 << 17)	// Device has a control queue
+#define VIRTIO_NET_F_MQ		(1 << 22)	// ... and multiple queue pairs
+
+#define VIRTIO_NET_CTRL_MQ		4	// Control class: queue pairs
+#define VIRTIO_NET_CTRL_MQ_PAIRS_SET	0	// Set how many we use
+
+#define VRING_DESC_F_NEXT	1	// Buffer continues in desc.next
+#define VRING_DESC_F_WRITE	2	// Buffer is for the device to fill
+#define VRING_AVAIL_F_NO_INTERRUPT 1	// Driver: don't interrupt us
+#define VRING_USED_F_NO_NOTIFY	1	// Device: don't notify me
+
+struct virtio_desc {
+	volatile uint64_t addr;
+	volatile uint32_t len;
+	volatile uint16_t flags;
+	volatile uint16_t next;
+};
+
+struct virtio_avail {
+	volatile uint16_t flags;
+	volatile uint16_t idx;
+	volatile uint16_t ring[0];
+};
+
+struct virtio_usedelem {
+	volatile uint32_t id;		// Head of the descriptor chain
+	volatile uint32_t len;		// Bytes the device wrote into it
+};
+
+struct virtio_used {
+	volatile uint16_t flags;
+	volatile uint16_t idx;
+	struct virtio_usedelem ring[0];
+};
+
+// Header prefixed to every frame, in its own descriptor
+struct virtio_nethdr {
+	uint8_t		flags;
+	uint8_t		gso_type;
+	uint16_t	hdr_len;
+	uint16_t	gso_size;
+	uint16_t	csum_start;
+	uint16_t	csum_offset;
+};
+
+// Each queue's descriptors are dealt out in fixed-size chains,
+// one chain per slot: two (header, frame) for receiving,
+// three (header, packet head, packet body) for transmitting,
+// so a used chain's head descriptor tells us its slot.
+struct virtio_slot {
+	char *buf;		// Header and, unless zero-copy, frame
+	pageinfo *hold[2];	// Pages virtio_txz() is sending from
+};
+
+typedef struct virtio_queue {
+	spinlock lock;
+	int index;		// Queue number on the device
+	int size;		// Number of descriptors
+	int chain;		// Descriptors per slot
+	int nslot;
+	struct virtio_desc *desc;
+	struct virtio_avail *avail;
+	struct virtio_used *used;
+	uint16_t usedidx;	// Next used entry we haven't looked at
+	bool busy;		// Some CPU is delivering this queue's frames
+	int nfree;		// Free transmit slots, stacked in free[]
+	int free[VIRTIO_QMAX];
+	struct virtio_slot slot[VIRTIO_QMAX];
+} virtio_queue;
+
+static struct {
+	int iobase;
+	int npairs;		// Queue pairs in use
+	virtio_queue rxq[VIRTIO_MAXPAIRS];
+	virtio_queue txq[VIRTIO_MAXPAIRS];
+	virtio_queue ctlq;
+	uint8_t mac[6];
+} virtio;
+
+static uint8_t virtio_rings[VIRTIO_MAXQ][VIRTIO_RINGPAGES*PAGESIZE]
+	gcc_aligned(PAGESIZE);
+
+
+// Order our accesses to shared rings against the device's.
+static inline void
+virtio_mb(void)
+{
+	asm volatile("mfence" : : : "memory");
+}
+
+// Tell the device there's something new in q's available ring,
+// unless it has told us it's looking anyway.
+static void
+virtio_notify(virtio_queue *q)
+{
+	virtio_mb();
+	if (!(q->used->flags & VRING_USED_F_NO_NOTIFY))
+		outw(virtio.iobase + VIRTIO_PCI_QNOTIFY, q->index);
+}
+
+// Make slot s of q available to the device.
+static void
+virtio_post(virtio_queue *q, int s)
+{
+	q->avail->ring[q->avail->idx % q->size] = s * q->chain;
+	virtio_mb();
+	q->avail->idx++;
+}
+
+// Take the device's next finished slot from q, or return -1 if none.
+// Stores the bytes the device wrote into it in *len.
+static int
+virtio_used(virtio_queue *q, int *len)
+{
+	if (q->usedidx == q->used->idx)
+		return -1;
+	virtio_mb();
+	struct virtio_usedelem *e = &q->used->ring[q->usedidx % q->size];
+	q->usedidx++;
+	if (len)
+		*len = e->len;
+	return e->id / q->chain;
+}
+
+// Set up device queue number index with chains of chain descriptors,
+// and give each slot a buffer for packets.
+static int
+virtio_qinit(virtio_queue *q, int index, uint8_t *ring, int chain)
+{
+	int s, i;
+
+	outw(virtio.iobase + VIRTIO_PCI_QSEL, index);
+	int size = inw(virtio.iobase + VIRTIO_PCI_QSIZE);
+	if (size == 0 || size > VIRTIO_QMAX) {
+		warn("virtio: queue %d has %d descriptors", index, size);
+		return 0;
+	}
+
+	spinlock_init(&q->lock);
+	q->index = index;
+	q->size = size;
+	q->chain = chain;
+	q->nslot = size / chain;
+	memset(ring, 0, VIRTIO_RINGPAGES*PAGESIZE);
+	q->desc = (struct virtio_desc*) ring;
+	q->avail = (struct virtio_avail*) (ring + size*sizeof(*q->desc));
+	q->used = (struct virtio_used*) ROUNDUP(ring + size*sizeof(*q->desc)
+			+ sizeof(*q->avail) + (size+1)*sizeof(uint16_t),
+			PAGESIZE);
+	assert((uint8_t*) &q->used->ring[size+1] <= ring
+			+ VIRTIO_RINGPAGES*PAGESIZE);
+
+	for (s = 0; s < q->nslot; s++) {
+		if (s % (PAGESIZE/VIRTIO_BUFSIZE) == 0) {
+			pageinfo *pi = mem_alloc();
+			if (pi == NULL) {
+				warn("virtio: out of memory for buffers");
+				return 0;
+			}
+			mem_incref(pi);
+			q->slot[s].buf = mem_pi2ptr(pi);
+		} else
+			q->slot[s].buf = q->slot[s-1].buf + VIRTIO_BUFSIZE;
+		memset(q->slot[s].buf, 0, VIRTIO_PKTOFF);
+		for (i = 0; i < chain; i++) {
+			struct virtio_desc *d = &q->desc[s*chain + i];
+			d->next = s*chain + i + 1;
+		}
+		q->free[s] = s;
+	}
+	q->nfree = q->nslot;
+
+	outl(virtio.iobase + VIRTIO_PCI_QADDR, mem_phys(ring) / PAGESIZE);
+	return 1;
+}
+
+// Hand all of receive queue q's slots to the device to fill.
+static void
+virtio_rxinit(virtio_queue *q)
+{
+	int s;
+
+	for (s = 0; s < q->nslot; s++) {
+		struct virtio_desc *d = &q->desc[s*2];
+		d[0].addr = mem_phys(q->slot[s].buf);
+		d[0].len = sizeof(struct virtio_nethdr);
+		d[0].flags = VRING_DESC_F_WRITE | VRING_DESC_F_NEXT;
+		d[1].addr = mem_phys(q->slot[s].buf + VIRTIO_PKTOFF);
+		d[1].len = NET_MAXPKT;
+		d[1].flags = VRING_DESC_F_WRITE;
+		virtio_post(q, s);
+	}
+	q->nfree = 0;
+	virtio_notify(q);
+}
+
+// Send a command on the control queue and wait for the device's verdict.
+static int
+virtio_ctl(uint8_t class, uint8_t cmd, void *data, int len)
+{
+	virtio_queue *q = &virtio.ctlq;
+	char *buf = q->slot[0].buf;
+	struct virtio_desc *d = q->desc;
+	int i;
+
+	assert(len <= VIRTIO_BUFSIZE - 32);
+	buf[0] = class;
+	buf[1] = cmd;
+	memcpy(buf + 16, data, len);
+	buf[VIRTIO_BUFSIZE-1] = 0xff;
+	d[0].addr = mem_phys(buf);
+	d[0].len = 2;
+	d[0].flags = VRING_DESC_F_NEXT;
+	d[1].addr = mem_phys(buf + 16);
+	d[1].len = len;
+	d[1].flags = VRING_DESC_F_NEXT;
+	d[2].addr = mem_phys(buf + VIRTIO_BUFSIZE-1);
+	d[2].len = 1;
+	d[2].flags = VRING_DESC_F_WRITE;
+	virtio_post(q, 0);
+	virtio_notify(q);
+
+	for (i = 0; i < 1000000 && virtio_used(q, NULL) < 0; i++)
+		pause();
+	return buf[VIRTIO_BUFSIZE-1] == 0;
+}
+
+int
+virtio_attach(struct pci_func *pcif)
+{
+	int i;
+
+	pci_func_enable(pcif);
+	virtio.iobase = pcif->reg_base[0];
+	virtio_irq = pcif->irq_line;
+
+	outb(virtio.iobase + VIRTIO_PCI_STATUS, 0);	// reset
+	outb(virtio.iobase + VIRTIO_PCI_STATUS,
+		VIRTIO_STATUS_ACK | VIRTIO_STATUS_DRIVER);
+
+	uint32_t feat = inl(virtio.iobase + VIRTIO_PCI_HOSTFEAT)
+		& (VIRTIO_NET_F_MAC | VIRTIO_NET_F_CTRL_VQ | VIRTIO_NET_F_MQ);
+	if (!(feat & VIRTIO_NET_F_CTRL_VQ))
+		feat &= ~VIRTIO_NET_F_MQ;
+	if (!(feat & VIRTIO_NET_F_MAC)) {
+		warn("virtio: device has no MAC address");
+		goto fail;
+	}
+	outl(virtio.iobase + VIRTIO_PCI_GUESTFEAT, feat);
+
+	// The control queue comes after all the pairs the device has,
+	// whether or not we use them all.
+	int maxpairs = 1;
+	if (feat & VIRTIO_NET_F_MQ)
+		maxpairs = inw(virtio.iobase + VIRTIO_PCI_CONFIG
+				+ VIRTIO_NET_CFG_MAXPAIRS);
+	virtio.npairs = MAX(MIN(maxpairs, VIRTIO_MAXPAIRS), 1);
+
+	for (i = 0; i < virtio.npairs; i++)
+		if (!virtio_qinit(&virtio.rxq[i], 2*i, virtio_rings[2*i], 2)
+				|| !virtio_qinit(&virtio.txq[i], 2*i+1,
+						virtio_rings[2*i+1], 3))
+			goto fail;
+	if ((feat & VIRTIO_NET_F_CTRL_VQ) && !virtio_qinit(&virtio.ctlq,
+			2*maxpairs, virtio_rings[2*virtio.npairs], 3))
+		goto fail;
+
+	// Transmit queues never interrupt: we reclaim slots as we go.
+	for (i = 0; i < virtio.npairs; i++) {
+		virtio.txq[i].avail->flags = VRING_AVAIL_F_NO_INTERRUPT;
+		virtio_rxinit(&virtio.rxq[i]);
+	}
+
+	for (i = 0; i < 6; i++)
+		virtio.mac[i] = inb(virtio.iobase + VIRTIO_PCI_CONFIG
+					+ VIRTIO_NET_CFG_MAC + i);
+	cprintf("virtio: MAC address");
+	for (i = 0; i < 6; i++)
+		cprintf("%c%02x", i ? ':' : ' ', virtio.mac[i]);
+	cprintf(", %d queue pair%s\n", virtio.npairs,
+		virtio.npairs > 1 ? "s" : "");
+	memcpy(net_mac, virtio.mac, 6);
+
+	outb(virtio.iobase + VIRTIO_PCI_STATUS, VIRTIO_STATUS_ACK
+		| VIRTIO_STATUS_DRIVER | VIRTIO_STATUS_DRIVER_OK);
+
+	if (virtio.npairs > 1) {
+		uint16_t n = virtio.npairs;
+		if (!virtio_ctl(VIRTIO_NET_CTRL_MQ,
+				VIRTIO_NET_CTRL_MQ_PAIRS_SET, &n, sizeof(n))) {
+			warn("virtio: device refused %d queue pairs", n);
+			virtio.npairs = 1;
+		}
+	}
+
+	// Enable network card interrupts
+	pic_enable(virtio_irq);
+	ioapic_enable(virtio_irq);
+
+	virtio_present = 1;
+	return 1;
+
+fail:
+	outb(virtio.iobase + VIRTIO_PCI_STATUS, VIRTIO_STATUS_FAILED);
+	return 0;
+}
+
+// Free transmit slots the device has finished sending from.
+static void
+virtio_txdone(virtio_queue *q)
+{
+	assert(spinlock_holding(&q->lock));
+	int s, j;
+
+	while ((s = virtio_used(q, NULL)) >= 0) {
+		for (j = 0; j < 2; j++)
+			if (q->slot[s].hold[j] != NULL) {
+				mem_decref(q->slot[s].hold[j], mem_free);
+				q->slot[s].hold[j] = NULL;
+			}
+		q->free[q->nfree++] = s;
+	}
+}
+
+// Find the transmit queue for the node hdr's Ethernet header is bound for,
+// lock it, and get a free slot, or return -1 with the queue unlocked
+// if it's full.  Each peer always goes out the same queue, so the frames
+// we send it can't overtake one another on the way to the wire.
+static int
+virtio_txslot(void *hdr, virtio_queue **qp)
+{
+	uint8_t node = ((net_ethhdr *) hdr)->dst[5];
+	virtio_queue *q = &virtio.txq[node % virtio.npairs];
+
+	spinlock_acquire(&q->lock);
+	if (q->nfree == 0)
+		virtio_txdone(q);
+	if (q->nfree == 0) {
+		spinlock_release(&q->lock);
+		return -1;
+	}
+	*qp = q;
+	return q->free[--q->nfree];
+}
+
+int
+virtio_tx(void *hdr, int hlen, void *body, int blen)
+{
+	assert(hlen + blen <= NET_MAXPKT);
+	virtio_queue *q;
+
+	int s = virtio_txslot(hdr, &q);
+	if (s < 0)
+		return 0;
+
+	char *buf = q->slot[s].buf;
+	memcpy(buf + VIRTIO_PKTOFF, hdr, hlen);
+	memcpy(buf + VIRTIO_PKTOFF + hlen, body, blen);
+
+	struct virtio_desc *d = &q->desc[s*3];
+	d[0].addr = mem_phys(buf);
+	d[0].len = sizeof(struct virtio_nethdr);
+	d[0].flags = VRING_DESC_F_NEXT;
+	d[1].addr = mem_phys(buf + VIRTIO_PKTOFF);
+	d[1].len = hlen + blen;
+	d[1].flags = 0;
+	virtio_post(q, s);
+	virtio_notify(q);
+
+	spinlock_release(&q->lock);
+	return 1;
+}
+
+// Reference the page holding buf until the device is done with it,
+// or return NULL if buf isn't within one allocated page.
+static pageinfo *
+virtio_hold(void *buf, int len)
+{
+	if (ROUNDDOWN(mem_phys(buf), PAGESIZE)
+			!= ROUNDDOWN(mem_phys(buf) + len - 1, PAGESIZE))
+		return NULL;
+	pageinfo *pi = mem_ptr2pi(buf);
+	if (pi <= &mem_pageinfo[0] || pi >= &mem_pageinfo[mem_npage]
+			|| pi->refcount == 0)
+		return NULL;
+	mem_incref(pi);
+	return pi;
+}
+
+// Transmit a packet straight from hdr and body, as e100_txz() does.
+int
+virtio_txz(void *hdr, int hlen, void *body, int blen)
+{
+	assert(hlen + blen <= NET_MAXPKT);
+	virtio_queue *q;
+
+	pageinfo *hpi = virtio_hold(hdr, hlen), *bpi = NULL;
+	if (hpi == NULL || (blen > 0 && (bpi = virtio_hold(body, blen)) == NULL)) {
+		if (hpi != NULL)
+			mem_decref(hpi, mem_free);
+		return virtio_tx(hdr, hlen, body, blen);
+	}
+
+	int s = virtio_txslot(hdr, &q);
+	if (s < 0) {
+		mem_decref(hpi, mem_free);
+		if (bpi != NULL)
+			mem_decref(bpi, mem_free);
+		return 0;
+	}
+	q->slot[s].hold[0] = hpi;
+	q->slot[s].hold[1] = bpi;
+
+	struct virtio_desc *d = &q->desc[s*3];
+	d[0].addr = mem_phys(q->slot[s].buf);
+	d[0].len = sizeof(struct virtio_nethdr);
+	d[0].flags = VRING_DESC_F_NEXT;
+	d[1].addr = mem_phys(hdr);
+	d[1].len = hlen;
+	d[1].flags = blen > 0 ? VRING_DESC_F_NEXT : 0;
+	d[2].addr = blen > 0 ? mem_phys(body) : 0;
+	d[2].len = blen;
+	d[2].flags = 0;
+	virtio_post(q, s);
+	virtio_notify(q);
+
+	spinlock_release(&q->lock);
+	return 1;
+}
+
+// Dispatch up to budget frames from receive queue q to the network stack,
+// and return true if more are waiting after that.
+// The queue stays unlocked while the stack handles them,
+// but only one CPU at a time delivers from a given queue,
+// so its frames reach net_rx() in the order they arrived;
+// anyone else finds it busy and just reports more waiting.
+static bool
+virtio_rx(virtio_queue *q, int budget)
+{
+	int slot[VIRTIO_RX_BUDGET], len[VIRTIO_RX_BUDGET];
+	int n = 0, i;
+
+	assert(budget <= VIRTIO_RX_BUDGET);
+	spinlock_acquire(&q->lock);
+	if (q->busy) {
+		spinlock_release(&q->lock);
+		return 1;
+	}
+	q->busy = 1;
+	while (n < budget && (slot[n] = virtio_used(q, &len[n])) >= 0)
+		n++;
+	spinlock_release(&q->lock);
+
+	for (i = 0; i < n; i++) {
+		int l = len[i] - (int) sizeof(struct virtio_nethdr);
+		if (l > 0 && l <= NET_MAXPKT)
+			net_rx(q->slot[slot[i]].buf + VIRTIO_PKTOFF, l);
+		else
+			warn("virtio: bad receive length %d", len[i]);
+	}
+
+	spinlock_acquire(&q->lock);
+	for (i = 0; i < n; i++)
+		virtio_post(q, slot[i]);
+	if (n > 0)
+		virtio_notify(q);
+	bool more = q->usedidx != q->used->idx;
+	q->busy = 0;
+	spinlock_release(&q->lock);
+	return more;
+}
+
+// Turn the receive queues' interrupts off or back on.
+static void
+virtio_rxintr(bool on)
+{
+	int i;
+
+	for (i = 0; i < virtio.npairs; i++)
+		virtio.rxq[i].avail->flags = on ? 0 : VRING_AVAIL_F_NO_INTERRUPT;
+	virtio_mb();
+}
+
+void
+virtio_intr(void)
+{
+	int i;
+
+	inb(virtio.iobase + VIRTIO_PCI_ISR);	// ack the interrupt
+	if (virtio_polling)
+		return;		// virtio_poll() is on it
+
+	// Take one batch from each queue; if any has more,
+	// turn receive interrupts off and leave the rest to virtio_poll().
+	bool more = false;
+	for (i = 0; i < virtio.npairs; i++)
+		more |= virtio_rx(&virtio.rxq[i], VIRTIO_RX_BUDGET);
+	if (more && !virtio_polling) {
+		virtio_polling = 1;
+		virtio_rxintr(false);
+	}
+}
+
+// Called from the clock tick and from idle CPUs.
+void
+virtio_poll(void)
+{
+	int i;
+
+	if (!virtio_present)
+		return;
+
+	for (i = 0; i < virtio.npairs; i++) {
+		virtio_queue *q = &virtio.txq[i];
+		spinlock_acquire(&q->lock);
+		virtio_txdone(q);
+		spinlock_release(&q->lock);
+	}
+
+	if (!virtio_polling)
+		return;
+	bool more = false;
+	for (i = 0; i < virtio.npairs; i++)
+		more |= virtio_rx(&virtio.rxq[i], VIRTIO_RX_BUDGET);
+	if (more)
+		return;
+
+	// Drained: interrupts back on, then look once more
+	// for a frame that arrived before the device could see that.
+	virtio_rxintr(true);
+	for (i = 0; i < virtio.npairs; i++) {
+		virtio_queue *q = &virtio.rxq[i];
+		if (q->usedidx != q->used->idx) {
+			virtio_rxintr(false);
+			return;
+		}
+	}
+	virtio_polling = 0;
+}
+
+// Receive buffers the device has yet to fill, over all queues.
+int
+virtio_rxroom(void)
+{
+	int room = 0, i;
+
+	for (i = 0; i < virtio.npairs; i++)
+		room += (uint16_t) (virtio.rxq[i].avail->idx
+					- virtio.rxq[i].used->idx);
+	return room;
+}
+
+#endif	// LAB >= 9
@@ -0,0 +1,26 @@
+#if LAB >= 9
+// Virtio network interface device driver definitions
+#ifndef PIOS_DEV_VIRTIO_H
+#define PIOS_DEV_VIRTIO_H
+#ifndef PIOS_KERNEL
+# error "This is a kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+
+struct pci_func;
+
+extern bool virtio_present;
+extern uint8_t virtio_irq;
+extern volatile bool virtio_polling;	// Receive interrupts off; poll us
+
+int  virtio_attach(struct pci_func *pcif);
+int  virtio_tx(void *hdr, int hlen, void *body, int blen);
+int  virtio_txz(void *hdr, int hlen, void *body, int blen);
+void virtio_intr(void);
+void virtio_poll(void);
+int  virtio_rxroom(void);
+
+#endif	// PIOS_DEV_VIRTIO_H
+#endif	// LAB >= 9
@@ -5,10 +5,11 @@
 
 #include <inc/vm.h>
 
-#define MAXTHREADS	(32)
+#define MAXTHREADS	(256)	// one arena per child number (PROC_CHILDREN)
 #define HEAP_HI		VM_SHAREHI
 #define HEAP_LO		(VM_SHARELO + (VM_SHAREHI - VM_SHARELO)/2)
 #define HEAP_SZ		((HEAP_HI - HEAP_LO)/MAXTHREADS)
+#define THHEAP_INIT	(1024*1024)	// part of an arena mapped at fork
 
 #define USE_DL_PREFIX //to override all DL functions.
 /*
@@ -18,7 +19,14 @@
 #define threalloc				realloc
 */
 
+void thfork(int t);
 void *thmalloc(size_t bytes);
+
+// Free a chunk.  A child may free only chunks from its own arena;
+// a sibling's chunk is silently left allocated.
+// Thread 0 may free any chunk, but only once it has joined the
+// chunk's owner: freeing from a child that is still running
+// rewrites that child's allocator state, and the next merge conflicts.
 void thfree(void *mem);
 void *thcalloc(size_t num, size_t bytes);
 void *threalloc(void *mem, size_t bytes);
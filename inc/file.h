@@ -134,6 +134,10 @@ typedef struct procinfo {
 #define PROC_FREE	0		// Unused child, available for fork()
 #define PROC_RESERVED	(-1)		// Child reserved for special purpose
 #define PROC_FORKED	1		// This child forked and running
+#if LAB >= 9
+#define PROC_BARRIER	2		// pthread stopped at a barrier
+#define PROC_IDLE	3		// worker finished, kept for reuse
+#endif
 #define PROC_CHILDREN	FILE_INODES		// Size of child array
 
 
@@ -149,7 +153,9 @@ typedef struct filestate {
 #if LAB >= 9
 	int		thself;		// This thread's number, 0 if master
 	void *		thstat;		// Thread exit status - pthread_exit()
-	int		barriers[PROC_CHILDREN];  // pthread barriers
+	int		thpath[PROC_CHILDREN];	// pthread id -> path to thread
+	int		taskcpus;	// CPUs task_sync() may keep busy
+	bool		taskany;	// task_sync() may wait in any order
 #endif
 } filestate;
 
@@ -50,5 +50,7 @@ void *mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset)
 
 int munmap(void *addr, size_t length);
 
+int madvise(void *addr, size_t length, int advice);
+
 #endif /* __PIOS_MMAN_H__ */
 #endif	// LAB >= 9
@@ -50,6 +50,20 @@
 #define SYS_COPY	0x00020000	// Get/put virtual copy
 #define SYS_MERGE	0x00030000	// Get: diffs only from last snapshot
 #define SYS_SNAP	0x00040000	// Put: snapshot child state
+#if LAB >= 9
+#define SYS_SIBSNAP	0x00100000	// Put: snapshot copied range only,
+					// sharing it among sibling children
+#define SYS_PREFAULT	0x00200000	// Get: resolve copy-on-write pages
+					// in our dest range ahead of writes
+#define SYS_GROUP	0x00400000	// Put: child joins our round group;
+					// Get: from next member in turn
+#define SYS_ROUND	0x00800000	// Put: let kernel end member's rounds
+#define SYS_GANG	0x01000000	// Put: start child in a gang with
+					// siblings started the same way
+#define SYS_ANY		0x02000000	// Get: from any child in a set [ND]
+#define SYS_PRECOPY	0x04000000	// Get: don't migrate yet, just start
+					// pushing our memory to the node
+#endif
 #if LAB >= 99
 #define SYS_SHARE	0x00080000	// Fresh memory should be shared [ND]
 #endif
@@ -79,6 +93,9 @@
 #else
 //	EDX:	bits 7-0: Child process number to get/put
 #endif
+#if LAB >= 9
+//		if SYS_ANY: instead, pointer to a bitmap of child numbers
+#endif
 #if LAB >= 99
 //		8-15:	if SYS_PROC: process number in child to copy
 //		16-23:	if SYS_PROC: process number in parent to copy
@@ -196,6 +213,66 @@ sys_recv(uint64_t msgid)
 }
 
 #if LAB >= 9
+// Get from the next member of our round group in child-number order
+// that has stopped for us, cycling round from the last one we got,
+// waiting on each member still running to see whether it stops.
+// Returns its child number, or -1 if no member is left
+// that could ever stop for us.
+static int gcc_inline
+sys_getgroup(uint32_t flags, procstate *save,
+		void *childsrc, void *localdest, size_t size)
+{
+	int child;
+	asm volatile("int %1"
+		: "=a" (child)
+		: "i" (T_SYSCALL),
+		  "a" (SYS_GET | SYS_GROUP | flags),
+		  "b" (save),
+		  "d" (0),
+		  "S" (childsrc),
+		  "D" (localdest),
+		  "c" (size)
+		: "cc", "memory");
+	return child;
+}
+
+// Get from the lowest-numbered child in 'set' that has stopped,
+// a bitmap of PROC_CHILDREN bits, waiting for one if none has yet.
+// Returns its child number, or -1 if no child in the set exists.
+// Which child that is depends on timing, so the caller needs PFF_NONDET;
+// a child stays stopped once gotten, so drop it from the set before
+// asking again unless it has been restarted.
+static int gcc_inline
+sys_getany(uint32_t flags, const uint8_t *set, procstate *save,
+		void *childsrc, void *localdest, size_t size)
+{
+	int child;
+	asm volatile("int %1"
+		: "=a" (child)
+		: "i" (T_SYSCALL),
+		  "a" (SYS_GET | SYS_ANY | flags),
+		  "b" (save),
+		  "d" (set),
+		  "S" (childsrc),
+		  "D" (localdest),
+		  "c" (size)
+		: "cc", "memory");
+	return child;
+}
+
+// Start copying our memory to 'node' (0 = home) in the background
+// while we keep running, so that a later get or put that migrates us
+// there stops us only long enough to fetch the pages we dirtied since.
+static void gcc_inline
+sys_precopy(uint8_t node)
+{
+	asm volatile("int %0" :
+		: "i" (T_SYSCALL),
+		  "a" (SYS_GET | SYS_PRECOPY),
+		  "d" (node << 8)
+		: "cc", "memory");
+}
+
 static uint64_t gcc_inline
 sys_time(void)
 {
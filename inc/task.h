@@ -0,0 +1,41 @@
+#if LAB >= 9
+// Deterministic fork/join tasks for PIOS.
+//
+// A function spawns tasks into a task group on its own stack,
+// then waits for them all with task_sync().
+// Tasks run in child processes and hand back their results
+// through the usual snapshot/merge, so as long as the tasks of a group
+// write disjoint memory, the program's output never depends on
+// which worker ran which task or in what order:
+//
+//	taskgroup g = { 0 };
+//	task_spawn(&g, sortpart, &lo);
+//	task_spawn(&g, sortpart, &hi);
+//	task_sync(&g);
+//
+// In a process running with PFF_NONDET, task_sync() refills
+// whichever worker finishes first; the results are the same either way.
+//
+#ifndef PIOS_INC_TASK_H
+#define PIOS_INC_TASK_H
+
+#include <types.h>
+
+#define TASK_MAX	256	// tasks one group can hold before a sync
+
+typedef struct task {
+	void		(*fn)(void *);
+	void *		arg;
+} task;
+
+typedef struct taskgroup {
+	int		ntask;		// tasks spawned and not yet synced
+	task		task[TASK_MAX];
+} taskgroup;
+
+void	task_init(int ncpu);
+void	task_spawn(taskgroup *g, void (*fn)(void *), void *arg);
+void	task_sync(taskgroup *g);
+
+#endif	// !PIOS_INC_TASK_H
+#endif	// LAB >= 9
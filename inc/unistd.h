@@ -122,7 +122,9 @@ int	mkstemp(char *template);
 int	getopt(int argc, char * argv[], const char * optstring);
 #endif	// LAB >= 9
 
-// PIOS-specific thread fork/join functions
+// PIOS-specific process and thread fork/join functions
+int	forkslot(int slot, uint32_t flags);
+void	forkinit(void);
 int	tfork(uint16_t child);
 void	tjoin(uint16_t child);
 #if LAB >= 9
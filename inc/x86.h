@@ -411,27 +411,30 @@ bswap(uint64_t v)
 
 #if LAB >= 9
 // Read and write model-specific registers.
+// In 64-bit mode the "A" constraint doesn't mean EDX:EAX,
+// so the two halves must be passed separately.
 static gcc_inline uint64_t
 rdmsr(int32_t msr)
 {
-        uint64_t val;
-        asm volatile("rdmsr" : "=A" (val) : "c" (msr));
-        return val;
+        uint32_t lo, hi;
+        asm volatile("rdmsr" : "=a" (lo), "=d" (hi) : "c" (msr));
+        return (uint64_t)hi << 32 | lo;
 }
 
 static gcc_inline void
 wrmsr(int32_t msr, uint64_t val)
 {
-        asm volatile("wrmsr" : : "c" (msr), "A" (val));
+        asm volatile("wrmsr" : : "c" (msr),
+			"a" ((uint32_t)val), "d" ((uint32_t)(val >> 32)));
 }
 
 // Read performanc-monitoring counters.
 static gcc_inline uint64_t
 rdpmc(int32_t ctr)
 {
-        uint64_t v;
-        asm volatile("rdpmc" : "=A" (v) : "c" (ctr));
-        return v;
+        uint32_t lo, hi;
+        asm volatile("rdpmc" : "=a" (lo), "=d" (hi) : "c" (ctr));
+        return (uint64_t)hi << 32 | lo;
 }
 #endif // LAB >= 9
 
@@ -237,6 +237,13 @@ mem_free(pageinfo *pi)
 		panic("mem_free: attempt to free in-use page");
 	if (pi->free_next != NULL)
 		panic("mem_free: attempt to free already free page!");
+#if LAB >= 9
+	if (pi->base != NULL) {		// drop our delta base's pin
+		pageinfo *bpi = pi->base;
+		pi->base = NULL;
+		mem_decref(bpi, mem_free);
+	}
+#endif
 
 #if SOL >= 2
 	spinlock_acquire(&mem_freelock);
@@ -67,6 +67,9 @@ typedef struct pageinfo {
 	struct pageinfo *homelist;	// My pages with homes at this physaddr
 	struct pageinfo *homenext;	// Next pointer on homelist
 #endif
+#if LAB >= 9
+	struct pageinfo *base;		// Older version a peer may hold
+#endif
 } pageinfo;
 
 
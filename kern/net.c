@@ -18,6 +18,9 @@
 #include <kern/label.h>
 
 #include <dev/e100.h>
+#if LAB >= 9
+#include <dev/virtio.h>
+#endif
 #include <dev/timer.h>
 
 
@@ -30,6 +33,9 @@ proc *net_pulllist;	// List of processes currently pulling a page
 proc *net_sendlist;	// List of currently sending processes
 proc *net_recvlist;	// List of currently recving processes
 proc *net_fetchlist;	// List of currently fetching processes
+#if LAB >= 9
+proc *net_pushlist;	// List of processes pre-copying their memory
+#endif
 
 hashtable *net_waitmap;
 
@@ -65,6 +71,23 @@ void net_rxfetchrq(net_fetchrq *rq);
 void net_txfetchrp(proc *p, intptr_t srcaddr, int8_t part);
 void net_rxfetchrp(net_fetchrp *rp, int len);
 
+#if LAB >= 9
+static void net_pushtick(void);
+static void net_pushexpire(uint64_t now);
+static void net_rxpush(net_pushhdr *ph, int len);
+static void net_txmanifest(proc *p, uint8_t node);
+static void net_rxmanifest(net_manifest *mf, int len);
+static bool net_mftake(uint32_t rr, void *pg);
+#endif
+
+#if LAB >= 9
+static void net_xinit(void);
+static bool net_xrx(net_ethhdr *eth, net_xhdr *xh);
+static void net_xflush(uint8_t node);
+static void net_xtick(uint64_t now);
+static void net_zipcheck(void);
+#endif
+
 void
 net_init(void)
 {
@@ -72,6 +95,10 @@ net_init(void)
 		return;
 
 	spinlock_init(&net_lock);
+#if LAB >= 9
+	net_xinit();
+	net_zipcheck();
+#endif
 
 	pageinfo *pi = mem_alloc();
 	mem_incref(pi);
@@ -84,7 +111,11 @@ net_init(void)
 
 	net_waitmap = table_alloc();
 
+#if LAB >= 9
+	if (!e100_present && !virtio_present) {
+#else
 	if (!e100_present) {
+#endif
 		cprintf("No network card found; networking disabled\n");
 		return;
 	}
@@ -106,7 +137,379 @@ net_ethsetup(net_ethhdr *eth, uint8_t destnode)
 	eth->type = htons(NET_ETHERTYPE);
 }
 
-// Just a trivial wrapper for the e100 driver's transmit function.
+#if LAB >= 9
+// Hand a frame to the network card: virtio-net if we have one,
+// else the e100.  If inplace, the card may send straight from
+// hdr and body, which must then be parts of pages we hold.
+// Returns 0 if the card's transmit queue is full.
+static int
+net_ethtx(void *hdr, int hlen, void *body, int blen, bool inplace)
+{
+	if (virtio_present)
+		return inplace ? virtio_txz(hdr, hlen, body, blen)
+				: virtio_tx(hdr, hlen, body, blen);
+	return inplace ? e100_txz(hdr, hlen, body, blen)
+			: e100_tx(hdr, hlen, body, blen);
+}
+
+// Reliable transport.
+//
+// Each message net_tx() sends to a peer gets the next sequence number
+// for that peer and stays queued until the peer acknowledges it.
+// At most net_window queued frames are in flight to a peer at once;
+// the rest go out as acks open the window.
+// Receivers accept frames only in order and acknowledge cumulatively,
+// piggybacking the ack on any frame they send back, or else in a pure ack.
+// A frame out of order is dropped and re-acked right away,
+// so three duplicate acks tell the sender to go back to its oldest frame
+// without waiting for the retransmit timer.
+// The retransmit timeout tracks the measured round trip time
+// as in TCP (RFC 6298), in PIT ticks as returned by timer_read().
+
+#define NET_RTOMIN	(TIMER_FREQ/100)	// 10ms
+#define NET_RTOINIT	(TIMER_FREQ/4)		// 250ms, until we've timed a frame
+#define NET_RTOMAX	(TIMER_FREQ*4)		// 4s
+
+#define SEQ_LT(a,b)	((int32_t)((a) - (b)) < 0)
+#define SEQ_LE(a,b)	((int32_t)((a) - (b)) <= 0)
+#define SEQ_NEXT(a)	((uint32_t)((a) + 1) != 0 ? (a) + 1 : 1)  // 0: pure ack
+
+// A queued frame, which occupies a page of its own.
+// A frame sent with net_txpage() keeps its body where it is,
+// in a page the frame holds a reference to,
+// and the card gathers the two straight from memory.
+typedef struct net_xbuf {
+	struct net_xbuf	*next;
+	uint32_t	seq;
+	int		len;
+	void		*body;		// Body sent in place, or NULL
+	int		blen;
+	char		frame[0];	// Ethernet header, net_xhdr, message
+} net_xbuf;
+
+typedef struct net_peer {
+	// Sending side
+	uint32_t	txnext;		// Sequence number for the next new frame
+	uint32_t	txuna;		// Oldest unacknowledged sequence number
+	uint32_t	txsent;		// Frames before this have been sent
+	net_xbuf	*txq;		// Queued frames, txuna first
+	net_xbuf	**txqtail;
+	int		ntxq;
+	int		ndupack;	// Duplicate acks for txuna seen in a row
+	uint32_t	rttseq;		// Frame being timed, 0 if none
+	uint64_t	rttstart;	// When it was sent
+	uint64_t	srtt;		// Smoothed round trip time, 0 if unknown
+	uint64_t	rttvar;		// Round trip time's mean deviation
+	uint64_t	rto;		// Current retransmit timeout
+	uint64_t	rtxtime;	// Retransmit deadline, 0 if none in flight
+
+	// Receiving side
+	uint32_t	rxepoch;	// Peer's epoch, 0 if never heard from
+	uint32_t	rxnext;		// Sequence number expected next from peer
+	bool		ackdue;		// We owe the peer an ack
+	uint32_t	txwnd;		// Frames the peer last had room for
+} net_peer;
+
+int net_window = NET_WINDOW;
+
+static spinlock net_xlock;
+static uint32_t net_epoch;
+static net_peer net_peers[NET_MAXNODES+1];
+
+// Release a queued frame.  The card may still hold it for a while.
+static void
+net_xfree(net_xbuf *xb)
+{
+	if (xb->body != NULL)
+		mem_decref(mem_ptr2pi(xb->body), mem_free);
+	mem_decref(mem_ptr2pi(xb), mem_free);
+}
+
+// Forget all transport state for a peer, dropping whatever we had queued.
+static void
+net_xreset(net_peer *pr)
+{
+	while (pr->txq != NULL) {
+		net_xbuf *xb = pr->txq;
+		pr->txq = xb->next;
+		net_xfree(xb);
+	}
+	pr->txqtail = &pr->txq;
+	pr->ntxq = 0;
+	pr->txnext = pr->txuna = pr->txsent = 1;
+	pr->ndupack = 0;
+	pr->rttseq = 0;
+	pr->srtt = pr->rttvar = 0;
+	pr->rto = NET_RTOINIT;
+	pr->rtxtime = 0;
+	pr->rxnext = 1;
+	pr->ackdue = false;
+	pr->txwnd = NET_MAXQUEUE;
+}
+
+static void
+net_xinit(void)
+{
+	spinlock_init(&net_xlock);
+	net_epoch = (uint32_t) rdtsc() | 1;	// never 0
+	int i;
+	for (i = 1; i <= NET_MAXNODES; i++)
+		net_xreset(&net_peers[i]);
+}
+
+// Room our card has left for receiving frames, which we advertise
+// so that peers slow down before it starts dropping them.
+static uint32_t
+net_rxroom(void)
+{
+	int room = virtio_present ? virtio_rxroom() : e100_rxroom();
+	return MAX(room, 1);
+}
+
+// Send whatever queued frames the window allows that we haven't sent yet,
+// stopping early if the card runs out of transmit buffers.
+// The window is the smaller of ours and the room the peer advertised,
+// but always lets one frame through so the peer can tell us it has more.
+static void
+net_xpush(net_peer *pr)
+{
+	assert(spinlock_holding(&net_xlock));
+	int win = MIN(MAX(net_window, 1), NET_MAXQUEUE);
+	win = MIN(win, MAX(pr->txwnd, 1));
+	uint32_t room = 0;
+	uint64_t now = 0;
+	net_xbuf *xb;
+
+	for (xb = pr->txq; xb != NULL && SEQ_LT(xb->seq, pr->txsent); )
+		xb = xb->next;
+	for (; xb != NULL && SEQ_LT(xb->seq, pr->txuna + win); xb = xb->next) {
+		net_xhdr *xh = (net_xhdr*) (xb->frame + sizeof(net_ethhdr));
+		xh->ack = pr->rxnext;	// freshen the piggybacked ack
+		if (room == 0)
+			room = net_rxroom();
+		xh->wnd = room;
+		if (!net_ethtx(xb->frame, xb->len, xb->body, xb->blen, true))
+			break;		// net_txready() will try again
+		pr->ackdue = false;
+		pr->txsent = SEQ_NEXT(xb->seq);
+
+		if (now == 0)
+			now = timer_read();
+		if (pr->rttseq == 0) {
+			pr->rttseq = xb->seq;
+			pr->rttstart = now;
+		}
+		if (pr->rtxtime == 0)
+			pr->rtxtime = now + pr->rto;
+	}
+}
+
+// Take a round trip time sample and recompute the retransmit timeout.
+static void
+net_xrtt(net_peer *pr, uint64_t rtt)
+{
+	if (pr->srtt == 0) {
+		pr->srtt = rtt;
+		pr->rttvar = rtt / 2;
+	} else {
+		uint64_t dev = rtt > pr->srtt ? rtt - pr->srtt : pr->srtt - rtt;
+		pr->rttvar = (3 * pr->rttvar + dev) / 4;
+		pr->srtt = (7 * pr->srtt + rtt) / 8;
+	}
+	pr->rto = MIN(MAX(pr->srtt + 4 * pr->rttvar, NET_RTOMIN), NET_RTOMAX);
+}
+
+// Go back and resend everything in flight, starting with txuna.
+static void
+net_xrewind(net_peer *pr)
+{
+	pr->txsent = pr->txuna;
+	pr->rttseq = 0;		// Karn: don't time retransmitted frames
+	pr->rtxtime = 0;
+	pr->ndupack = 0;
+	net_xpush(pr);
+}
+
+// Process the transport header of a frame received from a peer.
+// Returns true if the message it carries is to be delivered.
+static bool
+net_xrx(net_ethhdr *eth, net_xhdr *xh)
+{
+	uint8_t node = eth->src[5];
+	net_peer *pr = &net_peers[node];
+
+	spinlock_acquire(&net_xlock);
+
+	// A new epoch means the peer restarted and forgot all about us.
+	if (xh->epoch != pr->rxepoch) {
+		if (pr->rxepoch != 0) {
+			warn("net_rx: node %d restarted", node);
+			net_xreset(pr);
+		}
+		pr->rxepoch = xh->epoch;
+	}
+	if (xh->wnd != 0)
+		pr->txwnd = xh->wnd;
+
+	// Free the frames this ack covers and open the window.
+	uint32_t ack = xh->ack;
+	if (SEQ_LT(pr->txuna, ack) && SEQ_LE(ack, pr->txsent)) {
+		while (pr->txq != NULL && SEQ_LT(pr->txq->seq, ack)) {
+			net_xbuf *xb = pr->txq;
+			pr->txq = xb->next;
+			pr->ntxq--;
+			net_xfree(xb);
+		}
+		if (pr->txq == NULL)
+			pr->txqtail = &pr->txq;
+		pr->txuna = ack;
+		pr->ndupack = 0;
+
+		uint64_t now = timer_read();
+		if (pr->rttseq != 0 && SEQ_LT(pr->rttseq, ack)) {
+			net_xrtt(pr, now - pr->rttstart);
+			pr->rttseq = 0;
+		}
+		pr->rtxtime = pr->txuna != pr->txsent ? now + pr->rto : 0;
+		net_xpush(pr);
+	} else if (ack == pr->txuna && xh->seq == 0
+			&& pr->txuna != pr->txsent && ++pr->ndupack == 3)
+		net_xrewind(pr);	// fast retransmit
+
+	if (xh->seq == 0) {		// pure ack
+		spinlock_release(&net_xlock);
+		return false;
+	}
+	pr->ackdue = true;
+	if (xh->seq != pr->rxnext) {	// duplicate or out of order
+		spinlock_release(&net_xlock);
+		net_xflush(node);	// re-ack at once
+		return false;
+	}
+	pr->rxnext = SEQ_NEXT(pr->rxnext);
+	spinlock_release(&net_xlock);
+	return true;
+}
+
+// Send a pure ack to a peer if nothing we sent since has carried one.
+static void
+net_xflush(uint8_t node)
+{
+	struct {
+		net_ethhdr	eth;
+		net_xhdr	xh;
+	} ackf;
+
+	spinlock_acquire(&net_xlock);
+	net_peer *pr = &net_peers[node];
+	if (pr->ackdue) {
+		net_ethsetup(&ackf.eth, node);
+		ackf.xh.epoch = net_epoch;
+		ackf.xh.seq = 0;
+		ackf.xh.ack = pr->rxnext;
+		ackf.xh.wnd = net_rxroom();
+		if (net_ethtx(&ackf, sizeof(ackf), NULL, 0, false))
+			pr->ackdue = false;
+	}
+	spinlock_release(&net_xlock);
+}
+
+// Called from net_tick() on every timer tick:
+// retransmit on timeout, and send whatever acks and frames are still due.
+// With now zero, nothing times out; see net_txready().
+static void
+net_xtick(uint64_t now)
+{
+	int node;
+
+	for (node = 1; node <= NET_MAXNODES; node++) {
+		net_peer *pr = &net_peers[node];
+		spinlock_acquire(&net_xlock);
+		if (pr->rtxtime != 0 && now >= pr->rtxtime) {
+			pr->rto = MIN(pr->rto * 2, NET_RTOMAX);	// back off
+			net_xrewind(pr);
+		} else if (pr->txsent != pr->txnext)
+			net_xpush(pr);
+		bool ackdue = pr->ackdue;
+		spinlock_release(&net_xlock);
+		if (ackdue)
+			net_xflush(node);
+	}
+}
+
+// The network card calls this when it has transmit buffers again
+// after turning a frame away for want of one,
+// so the frames and acks held back go out without waiting for a tick.
+void
+net_txready(void)
+{
+	net_xtick(0);
+}
+#endif	// LAB >= 9
+
+#if LAB >= 9
+// Queue a message for reliable, in-order delivery to its destination node.
+// If inplace is set, body stays put rather than being copied into the frame;
+// see net_txpage().
+// Returns 0 only if the peer's queue is full or we're out of memory,
+// in which case the protocol's own resends must recover.
+static int
+net_xqueue(void *hdr, int hlen, void *body, int blen, bool inplace)
+{
+	const int ethlen = sizeof(net_ethhdr);
+	assert(hlen >= ethlen);
+	assert(hlen + blen + sizeof(net_xhdr) <= NET_MAXPKT);
+	uint8_t node = ((net_ethhdr*) hdr)->dst[5];
+	assert(node > 0 && node <= NET_MAXNODES);
+	net_peer *pr = &net_peers[node];
+
+	spinlock_acquire(&net_xlock);
+	if (pr->ntxq >= NET_MAXQUEUE) {
+		spinlock_release(&net_xlock);
+		warn("net_tx: queue to node %d full", node);
+		return 0;
+	}
+	pageinfo *pi = mem_alloc();
+	if (pi == NULL) {
+		spinlock_release(&net_xlock);
+		warn("net_tx: out of memory");
+		return 0;
+	}
+	mem_incref(pi);
+
+	// Build the frame: Ethernet header, transport header, then the rest.
+	net_xbuf *xb = mem_pi2ptr(pi);
+	net_xhdr *xh = (net_xhdr*) (xb->frame + ethlen);
+	memcpy(xb->frame, hdr, ethlen);
+	xh->epoch = net_epoch;
+	xh->seq = pr->txnext;
+	pr->txnext = SEQ_NEXT(pr->txnext);
+	xh->wnd = 0;		// net_xpush() fills it in
+	memcpy(xh + 1, hdr + ethlen, hlen - ethlen);
+	xb->seq = xh->seq;
+	xb->len = hlen + sizeof(net_xhdr);
+	if (inplace && blen > 0) {
+		mem_incref(mem_ptr2pi(body));
+		xb->body = body;
+		xb->blen = blen;
+	} else {
+		memcpy(xb->frame + xb->len, body, blen);
+		xb->len += blen;
+		xb->body = NULL;
+		xb->blen = 0;
+	}
+	xb->next = NULL;
+	*pr->txqtail = xb;
+	pr->txqtail = &xb->next;
+	pr->ntxq++;
+
+	net_xpush(pr);
+	spinlock_release(&net_xlock);
+	return 1;
+}
+#endif	// LAB >= 9
+
+// Transmit a message to the node named in its Ethernet header.
 // The two buffers provided get concatenated to form the transmitted packet;
 // this is just a convenience (and optimization) for when the caller has a
 // "packet head" and a "packet body" coming from different memory areas.
@@ -114,9 +517,30 @@ net_ethsetup(net_ethhdr *eth, uint8_t destnode)
 int net_tx(void *hdr, int hlen, void *body, int blen)
 {
 //	cprintf("net_tx %x+%x\n", hlen, blen);
+#if LAB >= 9
+	return net_xqueue(hdr, hlen, body, blen, false);
+#else
 	return e100_tx(hdr, hlen, body, blen);
+#endif
 }
 
+#if LAB >= 9
+// Like net_tx(), but body is part of a page of memory that won't change
+// while the message is in flight, such as a shared page being pulled;
+// the frame references it in place and the card sends it from there,
+// saving copying each page twice on its way out.
+int net_txpage(void *hdr, int hlen, void *body, int blen)
+{
+	pageinfo *pi = mem_ptr2pi(body);
+	if (blen == 0 || pi <= &mem_pageinfo[0] || pi >= &mem_pageinfo[mem_npage]
+			|| pi->refcount == 0	// e.g., the kernel's zero page
+			|| ROUNDDOWN(mem_phys(body), PAGESIZE)
+			!= ROUNDDOWN(mem_phys(body) + blen - 1, PAGESIZE))
+		return net_xqueue(hdr, hlen, body, blen, false);
+	return net_xqueue(hdr, hlen, body, blen, true);
+}
+#endif
+
 // The e100 network interface device driver calls this
 // from its interrupt handler whenever it receives a packet.
 void
@@ -142,6 +566,26 @@ net_rx(void *pkt, int len)
 		return;	// drop
 	}
 
+#if LAB >= 9
+	// Let the transport see the frame, then strip its header
+	// by sliding the Ethernet header up over it.
+	uint8_t srcnode = h->eth.src[5];
+	if (len < sizeof(net_ethhdr) + sizeof(net_xhdr)) {
+		warn("net_rx: runt frame (%d bytes)", len);
+		return;	// drop
+	}
+	if (!net_xrx(&h->eth, (net_xhdr*) (pkt + sizeof(net_ethhdr))))
+		return;	// pure ack, duplicate, or out of order
+	memmove(pkt + sizeof(net_xhdr), pkt, sizeof(net_ethhdr));
+	pkt += sizeof(net_xhdr);
+	len -= sizeof(net_xhdr);
+	h = pkt;
+	if (len < sizeof(net_hdr)) {
+		warn("net_rx: runt packet (%d bytes)", len);
+		return net_xflush(srcnode);
+	}
+#endif
+
 #if SOL >= 5
 	switch (h->type) {
 	case NET_MIGRQ:
@@ -214,6 +658,22 @@ net_rx(void *pkt, int len)
 		}
 		net_rxfetchrp(pkt, len);
 		break;
+#if LAB >= 9
+	case NET_PUSH:
+		if (len < sizeof(net_pushhdr)) {
+			warn("net_rx: runt page push (%d bytes)", len);
+			return;	// drop
+		}
+		net_rxpush(pkt, len);
+		break;
+	case NET_MANIFEST:
+		if (len < sizeof(net_manifest)) {
+			warn("net_rx: runt manifest (%d bytes)", len);
+			return;	// drop
+		}
+		net_rxmanifest(pkt, len);
+		break;
+#endif
 	default:
 		warn("net_rx: unrecognized message type %x", h->type);
 		return;
@@ -222,6 +682,9 @@ net_rx(void *pkt, int len)
 	// Lab 5: your code here to process received messages.
 	warn("net_rx: received a message; now what?");
 #endif // ! SOL >= 5
+#if LAB >= 9
+	net_xflush(srcnode);	// ack unless the handler's replies already did
+#endif
 }
 
 // Called by trap() on every timer interrupt,
@@ -232,12 +695,29 @@ net_tick()
 	if (!cpu_onboot())
 		return;		// count only one CPU's ticks
 
+#if LAB >= 9
+	e100_poll();	// receive batches the NIC deferred, reclaim tx
+	virtio_poll();
+	net_xtick(timer_read());
+	net_pushtick();
+
+	// The transport recovers lost frames on its own,
+	// so resending whole requests is only a last resort,
+	// e.g., after a peer's queue overflowed or the peer restarted.
+	static int tick;
+	if (++tick & 255)
+		return;
+#else
 	static int tick;
 	if (++tick & 63)
 		return;
+#endif
 
 	spinlock_acquire(&net_lock);
 
+#if LAB >= 9
+	net_pushexpire(timer_read());
+#endif
 #if SOL >= 5
 	// Retransmit process migrate requests
 	proc *p;
@@ -272,6 +752,10 @@ net_tick()
 	for (p = net_fetchlist; p != NULL; p = p->remotenext) {
 		cprintf("retransmit fetchrq for %p\n", p);
 		spinlock_acquire(&p->lock);
+#if LAB >= 9
+		p->fetchwin = MAX(p->fetchwin / 2, 1);
+		p->fetchsent = 0;	// ask again for all that's missing
+#endif
 		net_txfetchrq(p);
 		spinlock_release(&p->lock);
 	}
@@ -298,6 +782,26 @@ net_rrshare(void *page, uint8_t dstnode)
 	pi->shared |= 1 << (dstnode-1);		// XXX lock_or?
 }
 
+#if LAB >= 9
+// Called when page pi is made as a private copy of page opi.
+// If opi's contents have a remote identity - it came from a peer,
+// or we've given a peer an RR to it - keep opi around as pi's base,
+// so that a peer holding that version can later pull pi as a delta.
+// A copy of a copy inherits the same base.
+// Chains are one deep, so mem_free() recurses just once:
+// a base with a base of its own isn't taken, and such a copy
+// goes out whole or compressed instead of as a delta.
+void
+net_setbase(pageinfo *pi, pageinfo *opi)
+{
+	pageinfo *bpi = opi->home != 0 || opi->shared != 0 ? opi : opi->base;
+	if (bpi == NULL || bpi->base != NULL || pi->base != NULL)
+		return;
+	mem_incref(bpi);
+	pi->base = bpi;
+}
+#endif
+
 // Called from syscall handlers to migrate to another node if we need to.
 // The 'node' argument is the node to migrate to.
 // The 'entry' argument is as for proc_save().
@@ -316,12 +820,29 @@ net_migrate(trapframe *tf, uint8_t dstnode, int entry)
 	// (In the case of a proc it won't anyway, but just for consistency.)
 	net_rrshare(p, dstnode);
 
+#if LAB >= 9
+	// If we've pushed its memory there, say which pages are still clean,
+	// ahead of the migrate request so they arrive first.
+	if (p->pushedto == dstnode)
+		net_txmanifest(p, dstnode);
+	p->pushedto = 0;
+#endif
 #if SOL >= 5
 	// Mark the process "migrating" and put it to sleep on the migrlist
 	spinlock_acquire(&net_lock);
 	assert(p->state == PROC_RUN);
 	assert(p->migrdest == 0);
 	assert(p->migrnext == NULL);
+#if LAB >= 9
+	if (p->pushdest != 0) {		// stop pre-copying; pulls do the rest
+		proc **pp = &net_pushlist;
+		while (*pp != p)
+			pp = &(*pp)->pushnext;
+		*pp = p->pushnext;
+		p->pushnext = NULL;
+		p->pushdest = 0;
+	}
+#endif
 	p->state = PROC_MIGR;
 	p->migrdest = dstnode;
 	p->migrnext = net_migrlist;
@@ -491,6 +1012,10 @@ net_pull(proc *p, uint32_t rr, void *pg, int pglevel)
 	p->pullpg = pg;
 	p->pglev = pglevel;
 	p->arrived = 0;		// Bitmask of page parts that have arrived
+#if LAB >= 9
+	p->pullfull = false;
+	p->pullhashed = false;
+#endif
 
 	// Ship out a pull request - net_tick() will retransmit if necessary.
 	net_txpullrq(p);
@@ -521,6 +1046,10 @@ net_txpullrq(proc *p)
 	rq.rr = p->pullrr;
 	rq.pglev = p->pglev;
 	rq.need = p->arrived ^ 7;	// Need all parts that haven't arrived
+#if LAB >= 9
+	rq.need |= NET_PULLZOK | (p->pullfull ? 0 : NET_PULLDOK)
+			| (p->pullhashed ? 0 : NET_PULLHOK);
+#endif
 	net_tx(&rq, sizeof(rq), NULL, 0);
 #else	// ! SOL >= 5
 	// Lab 5: transmit or retransmit a pull request (net_pullrq).
@@ -528,6 +1057,483 @@ net_txpullrq(proc *p)
 #endif	// ! SOL >= 5
 }
 
+#if LAB >= 9
+// Page compression.
+//
+// The compressed form of a page is a sequence of tokens,
+// each starting with a control byte c:
+//	0x00-0x7f	c+1 literal bytes follow
+//	0x80-0x8f	a run of ((c & 0xf) << 8 | next byte) + 1 zero bytes
+//	0xc0-0xff	copy (c & 0x3f) + 3 bytes from a distance of
+//			(next two bytes, little-endian) + 1 back in the output
+// Zero runs catch the mostly-empty pages typical of heaps and stacks,
+// and LZ matches found through a small hash table catch the rest.
+
+#define NET_ZHASH	1024		// Entries in compressor's hash table
+#define NET_ZMINRUN	4		// Shortest zero run worth a token
+#define NET_ZMAXLIT	128
+#define NET_ZMAXMATCH	(0x3f + 3)
+#define NET_ZSMALL	256		// Compressed size not worth a hash probe
+
+net_zstats net_zstat;
+
+// Emit src[lit..end) as literal tokens at dst[o], for net_zip().
+static int
+net_ziplit(const uint8_t *src, int lit, int end, uint8_t *dst, int o, int dmax)
+{
+	while (lit < end && o >= 0) {
+		int n = MIN(end - lit, NET_ZMAXLIT);
+		if (o + 1 + n > dmax)
+			return -1;
+		dst[o++] = n - 1;
+		memcpy(dst + o, src + lit, n);
+		o += n;
+		lit += n;
+	}
+	return o;
+}
+
+// Compress a page from src into dst, using htab (NET_ZHASH entries)
+// as scratch space.  Returns the compressed length,
+// or -1 if it would not fit in dmax bytes.
+static int
+net_zip(const uint8_t *src, uint8_t *dst, int dmax, uint16_t *htab)
+{
+	int i = 0, lit = 0, o = 0;
+
+	memset(htab, 0, NET_ZHASH * sizeof(uint16_t));
+	while (i < PAGESIZE) {
+		int zrun = 0, mlen = 0, mdist = 0;
+		while (i + zrun < PAGESIZE && src[i + zrun] == 0)
+			zrun++;
+		if (zrun < NET_ZMINRUN && i + 3 <= PAGESIZE) {
+			uint32_t h = (src[i] | src[i+1] << 8 | src[i+2] << 16)
+					* 2654435761U >> 22;
+			int cand = htab[h] - 1;		// 0 in htab means none
+			htab[h] = i + 1;
+			if (cand >= 0 && src[cand] == src[i]
+					&& src[cand+1] == src[i+1]
+					&& src[cand+2] == src[i+2]) {
+				mdist = i - cand;
+				mlen = 3;
+				while (mlen < NET_ZMAXMATCH && i + mlen < PAGESIZE
+						&& src[cand+mlen] == src[i+mlen])
+					mlen++;
+			}
+		}
+		if (zrun < NET_ZMINRUN && mlen == 0) {
+			i++;		// just one more literal byte
+			continue;
+		}
+
+		o = net_ziplit(src, lit, i, dst, o, dmax);
+		if (o < 0 || o + 3 > dmax)
+			return -1;
+		if (zrun >= NET_ZMINRUN) {
+			dst[o++] = 0x80 | (zrun - 1) >> 8;
+			dst[o++] = zrun - 1;
+			i += zrun;
+		} else {
+			dst[o++] = 0xc0 | (mlen - 3);
+			dst[o++] = mdist - 1;
+			dst[o++] = (mdist - 1) >> 8;
+			i += mlen;
+		}
+		lit = i;
+	}
+	return net_ziplit(src, lit, PAGESIZE, dst, o, dmax);
+}
+
+// Decompress a page compressed by net_zip().
+// Returns false if src is malformed or doesn't fill exactly one page.
+static bool
+net_unzip(const uint8_t *src, int slen, uint8_t *dst)
+{
+	int i = 0, o = 0, n;
+
+	while (i < slen) {
+		uint8_t c = src[i++];
+		if (c < 0x80) {			// literals
+			n = c + 1;
+			if (i + n > slen || o + n > PAGESIZE)
+				return false;
+			memcpy(dst + o, src + i, n);
+			i += n;
+		} else if (c < 0x90) {		// zero run
+			if (i + 1 > slen)
+				return false;
+			n = ((c & 0xf) << 8 | src[i++]) + 1;
+			if (o + n > PAGESIZE)
+				return false;
+			memset(dst + o, 0, n);
+		} else if (c >= 0xc0) {		// match
+			if (i + 2 > slen)
+				return false;
+			n = (c & 0x3f) + 3;
+			int dist = (src[i] | src[i+1] << 8) + 1;
+			i += 2;
+			if (dist > o || o + n > PAGESIZE)
+				return false;
+			int j;
+			for (j = 0; j < n; j++)	// may overlap, so bytewise
+				dst[o + j] = dst[o + j - dist];
+		} else
+			return false;
+		o += n;
+	}
+	return o == PAGESIZE;
+}
+
+// Compress page pg into zbuf, check it against maxlen if nonzero,
+// and check that it decompresses into out exactly, for net_zipcheck().
+// Returns the compressed length.
+static int
+net_zipcheck1(uint8_t *pg, uint8_t *zbuf, uint8_t *out, uint16_t *htab,
+		int maxlen)
+{
+	int zlen = net_zip(pg, zbuf, PAGESIZE, htab);
+	assert(zlen > 0);
+	assert(maxlen == 0 || zlen <= maxlen);
+	memset(out, 0xa5, PAGESIZE);
+	assert(net_unzip(zbuf, zlen, out));
+	assert(memcmp(pg, out, PAGESIZE) == 0);
+	return zlen;
+}
+
+// Check net_zip() and net_unzip() on pages of various kinds,
+// and that net_unzip() rejects streams that are cut short or corrupt.
+static void
+net_zipcheck(void)
+{
+	pageinfo *pi0 = mem_alloc(), *pi1 = mem_alloc();
+	pageinfo *pi2 = mem_alloc(), *pi3 = mem_alloc();
+	assert(pi0 && pi1 && pi2 && pi3);
+	uint8_t *pg = mem_pi2ptr(pi0), *out = mem_pi2ptr(pi1);
+	uint8_t *zbuf = mem_pi2ptr(pi2);
+	uint16_t *htab = mem_pi2ptr(pi3);
+	assert(NET_ZHASH * sizeof(uint16_t) <= PAGESIZE);
+	uint32_t seed = 1;
+	int i, zlen;
+#define NET_ZRAND()	(seed = seed * 1103515245 + 12345, seed >> 16)
+
+	// An all-zero page is a couple of zero-run tokens.
+	memset(pg, 0, PAGESIZE);
+	net_zipcheck1(pg, zbuf, out, htab, 4);
+
+	// A short repeating pattern is mostly matches.
+	for (i = 0; i < PAGESIZE; i++)
+		pg[i] = "pios, determinator"[i % 18];
+	zlen = net_zipcheck1(pg, zbuf, out, htab, PAGESIZE/16);
+
+	// Any cut short, or with extra bytes on the end, must be rejected.
+	int j;
+	for (j = 0; j < zlen; j++)
+		assert(!net_unzip(zbuf, j, out));
+	zbuf[zlen] = 0x00;
+	assert(!net_unzip(zbuf, zlen + 1, out));
+
+	// A sparse page, like a heap: random words among zeros.
+	memset(pg, 0, PAGESIZE);
+	for (i = 0; i < PAGESIZE / 8; i++)
+		if (NET_ZRAND() % 8 == 0)
+			((uint64_t*)pg)[i] = (uint64_t) NET_ZRAND() << 32
+						| NET_ZRAND();
+	net_zipcheck1(pg, zbuf, out, htab, PAGESIZE/2);
+
+	// Random data in the first half: all literals, yet still a round trip.
+	for (i = 0; i < PAGESIZE/2; i++)
+		pg[i] = NET_ZRAND();
+	net_zipcheck1(pg, zbuf, out, htab, 0);
+
+	// A wholly random page doesn't fit a frame, or even a page.
+	for (i = 0; i < PAGESIZE; i++)
+		pg[i] = NET_ZRAND();
+	assert(net_zip(pg, zbuf, NET_ZMAX, htab) == -1);
+	assert(net_zip(pg, zbuf, PAGESIZE, htab) == -1);
+
+	// Corrupt streams: an unused control byte,
+	// a match reaching back before the page,
+	// and zero runs overflowing the page.
+	static const uint8_t bad0[] = { 0x90, 0x00 };
+	static const uint8_t bad1[] = { 0x00, 'x', 0xc0, 0x01, 0x00,
+					0x8f, 0xff, 0x8f, 0xff };
+	static const uint8_t bad2[] = { 0x8f, 0xff, 0x8f, 0xff };
+	assert(!net_unzip(bad0, sizeof(bad0), out));
+	assert(!net_unzip(bad1, sizeof(bad1), out));
+	assert(!net_unzip(bad2, sizeof(bad2), out));
+	assert(!net_unzip(bad2, 0, out));
+#undef NET_ZRAND
+
+	mem_free(pi0);
+	mem_free(pi1);
+	mem_free(pi2);
+	mem_free(pi3);
+	cprintf("net_zipcheck() succeeded!\n");
+}
+
+// Hash a page's contents, so that two nodes can check that their copies
+// agree and find a page by its contents alone: MurmurHash3's x64 128-bit
+// variant, whose rotations and finalizer mix every input bit into every
+// output bit, so that no simple pattern of differences cancels out.
+static gcc_inline uint64_t
+net_rotl(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+static gcc_inline uint64_t
+net_fmix(uint64_t k)
+{
+	k ^= k >> 33;
+	k *= 0xff51afd7ed558ccdULL;
+	k ^= k >> 33;
+	k *= 0xc4ceb9fe1a85ec53ULL;
+	k ^= k >> 33;
+	return k;
+}
+
+static net_sum
+net_pagesum(const void *pg)
+{
+	const uint64_t c1 = 0x87c37b91114253d5ULL, c2 = 0x4cf5ad432745937fULL;
+	const uint64_t *w = pg;
+	uint64_t h1 = 0, h2 = 0;
+	int i;
+	for (i = 0; i < PAGESIZE/8; i += 2) {
+		uint64_t k1 = w[i], k2 = w[i+1];
+		h1 ^= net_rotl(k1 * c1, 31) * c2;
+		h1 = (net_rotl(h1, 27) + h2) * 5 + 0x52dce729;
+		h2 ^= net_rotl(k2 * c2, 33) * c1;
+		h2 = (net_rotl(h2, 31) + h1) * 5 + 0x38495ab5;
+	}
+	h1 ^= PAGESIZE;
+	h2 ^= PAGESIZE;
+	h1 += h2;
+	h2 += h1;
+	h1 = net_fmix(h1);
+	h2 = net_fmix(h2);
+	h1 += h2;
+	h2 += h1;
+	return (net_sum) { h1, h2 };
+}
+
+static gcc_inline bool
+net_sumeq(net_sum a, net_sum b)
+{
+	return a.lo == b.lo && a.hi == b.hi;
+}
+
+// Index of local pages by content hash, for NET_PULLHASH replies.
+// It holds only pages whose contents shouldn't change - pages we've pulled,
+// pages we've offered to peers, and pages peers have pushed to us -
+// and is direct-mapped and lossy,
+// so every hit is checked against the page's actual contents.
+#define NET_SUMSLOTS	16384	// Well above NET_PUSHCACHE
+
+static net_sum net_sumkey[NET_SUMSLOTS];
+static uint32_t net_sumaddr[NET_SUMSLOTS];	// Page's physical address
+
+static void
+net_suminsert(void *pg, net_sum sum)
+{
+	assert(spinlock_holding(&net_lock));
+	net_sumkey[sum.lo % NET_SUMSLOTS] = sum;
+	net_sumaddr[sum.lo % NET_SUMSLOTS] = mem_phys(pg);
+}
+
+// Find a local page with contents matching sum,
+// and return it with a reference held, or NULL if we have none.
+static pageinfo *
+net_sumfind(net_sum sum)
+{
+	assert(spinlock_holding(&net_lock));
+	if (!net_sumeq(net_sumkey[sum.lo % NET_SUMSLOTS], sum))
+		return NULL;
+	pageinfo *pi = mem_phys2pi(net_sumaddr[sum.lo % NET_SUMSLOTS]);
+	if (pi <= &mem_pageinfo[1] || pi >= &mem_pageinfo[mem_npage]
+			|| pi->refcount == 0)
+		return NULL;
+	mem_incref(pi);
+	if (!net_sumeq(net_pagesum(mem_pi2ptr(pi)), sum)) { // changed or reused
+		mem_decref(pi, mem_free);
+		return NULL;
+	}
+	return pi;
+}
+
+// Which peers we've sent each page's contents to, by hash,
+// as a guide to what those peers' own indexes are likely to hold.
+// Direct-mapped and lossy like the index: a wrong guess costs a round trip.
+static net_sum net_sentkey[NET_SUMSLOTS];
+static uint32_t net_sentnodes[NET_SUMSLOTS];	// Bitmask of peers
+
+// Note that we've sent node a page with contents sum.
+static void
+net_sentnote(net_sum sum, uint8_t node)
+{
+	assert(spinlock_holding(&net_lock));
+	int i = sum.lo % NET_SUMSLOTS;
+	if (!net_sumeq(net_sentkey[i], sum)) {
+		net_sentkey[i] = sum;
+		net_sentnodes[i] = 0;
+	}
+	net_sentnodes[i] |= 1 << (node-1);
+}
+
+// Have we sent node a page with contents sum?
+static bool
+net_sentto(net_sum sum, uint8_t node)
+{
+	assert(spinlock_holding(&net_lock));
+	int i = sum.lo % NET_SUMSLOTS;
+	return net_sumeq(net_sentkey[i], sum)
+		&& (net_sentnodes[i] & (1 << (node-1)));
+}
+
+// Try to send a whole data page in a single compressed pull reply.
+// If hashfirst is set, the page doesn't shrink to a few bytes,
+// and we've sent the requester these same contents before,
+// send just its content hash instead, as it likely still has a copy;
+// if not, it will ask again without NET_PULLHOK.
+// A page the requester has never seen goes out at once,
+// rather than costing it a second round trip.
+// Returns false if it didn't compress well enough to fit,
+// in which case the caller must send the page's parts raw.
+static bool
+net_txpullz(uint8_t rqnode, uint32_t rr, void *pg, bool hashfirst)
+{
+	pageinfo *pi = mem_alloc();
+	if (pi == NULL)
+		return false;
+	uint16_t *htab = mem_pi2ptr(pi);
+	uint8_t *zbuf = (uint8_t*) (htab + NET_ZHASH);
+	assert(NET_ZHASH * sizeof(uint16_t) + NET_ZMAX <= PAGESIZE);
+
+	net_sum sum = net_pagesum(pg);
+	spinlock_acquire(&net_lock);
+	hashfirst = hashfirst && net_sentto(sum, rqnode);
+	spinlock_release(&net_lock);
+
+	int zlen = net_zip(pg, zbuf, NET_ZMAX, htab);
+	if (hashfirst && (zlen < 0 || zlen > NET_ZSMALL))
+		zlen = -2;
+
+	net_pullrphdr rph;
+	net_ethsetup(&rph.eth, rqnode);
+	rph.type = NET_PULLRP;
+	rph.rr = rr;
+	if (zlen == -2) {
+		rph.part = NET_PULLHASH;
+		rph.sum = sum;
+		net_tx(&rph, sizeof(rph), NULL, 0);
+	} else if (zlen >= 0) {
+		rph.part = NET_PULLZIP;
+		net_tx(&rph, sizeof(rph), zbuf, zlen);
+	}
+	mem_free(pi);
+
+	if (zlen == -2) {
+		spinlock_acquire(&net_lock);
+		net_suminsert(pg, sum);
+		net_zstat.hashes++;
+		spinlock_release(&net_lock);
+		return true;
+	}
+
+	spinlock_acquire(&net_lock);
+	net_sentnote(sum, rqnode);	// zipped here, or raw by our caller
+	net_zstat.pages++;
+	net_zstat.rawbytes += PAGESIZE;
+	net_zstat.zpages += zlen >= 0;
+	net_zstat.wirebytes += zlen >= 0 ? zlen : PAGESIZE;
+	spinlock_release(&net_lock);
+	return zlen >= 0;
+}
+
+// Try to send data page pi as a compressed delta against its base,
+// if the requester should still hold that version:
+// either the requester's own page, or one we gave it an RR to.
+// Returns false if the caller must send the page some other way.
+static bool
+net_txpulld(uint8_t rqnode, uint32_t rr, pageinfo *pi)
+{
+	pageinfo *bpi = pi->base;
+	uint32_t base;
+	if (bpi == NULL)
+		return false;
+	if (bpi->home != 0) {
+		if (RRNODE(bpi->home) != rqnode)
+			return false;
+		base = bpi->home;
+	} else {
+		if (!(bpi->shared & (1 << (rqnode-1))))
+			return false;
+		base = RRCONS(net_node, mem_pi2phys(bpi), 0);
+	}
+
+	pageinfo *dpi = mem_alloc(), *zpi = mem_alloc();
+	if (dpi == NULL || zpi == NULL) {
+		if (dpi) mem_free(dpi);
+		if (zpi) mem_free(zpi);
+		return false;
+	}
+	const uint64_t *pw = mem_pi2ptr(pi), *bw = mem_pi2ptr(bpi);
+	uint64_t *dw = mem_pi2ptr(dpi);
+	int i;
+	for (i = 0; i < PAGESIZE/8; i++)
+		dw[i] = pw[i] ^ bw[i];
+	uint16_t *htab = mem_pi2ptr(zpi);
+	uint8_t *zbuf = (uint8_t*) (htab + NET_ZHASH);
+
+	int zlen = net_zip((uint8_t*) dw, zbuf, NET_ZMAX, htab);
+	if (zlen >= 0) {
+		net_pullrphdr rph;
+		net_ethsetup(&rph.eth, rqnode);
+		rph.type = NET_PULLRP;
+		rph.rr = rr;
+		rph.part = NET_PULLDELTA;
+		rph.base = base;
+		rph.sum = net_pagesum(bw);
+		net_tx(&rph, sizeof(rph), zbuf, zlen);
+
+		spinlock_acquire(&net_lock);
+		net_zstat.pages++;
+		net_zstat.dpages++;
+		net_zstat.rawbytes += PAGESIZE;
+		net_zstat.wirebytes += zlen;
+		spinlock_release(&net_lock);
+	}
+	mem_free(dpi);
+	mem_free(zpi);
+	return zlen >= 0;
+}
+
+// Find our copy of the delta base a peer named in a pull reply,
+// with a reference held on it, or NULL if we no longer have it.
+static pageinfo *
+net_pullbase(uint32_t base)
+{
+	if (RRNODE(base) == net_node) {		// One of our own pages
+		pageinfo *bpi = mem_phys2pi(RRADDR(base));
+		if (bpi <= &mem_pageinfo[1] || bpi >= &mem_pageinfo[mem_npage]
+				|| bpi->refcount == 0 || bpi->home != 0)
+			return NULL;
+		mem_incref(bpi);
+		return bpi;
+	}
+
+	// Our copy of a peer's page is tracked under the RR we pulled it by,
+	// whose nominal permissions the peer doesn't know.
+	int perm;
+	for (perm = 0; perm <= RR_RW; perm += SYS_READ) {
+		pageinfo *bpi = mem_rrlookup(base | perm);
+		if (bpi != NULL)
+			return bpi;
+	}
+	return NULL;
+}
+#endif	// LAB >= 9
+
 // Process a page pull request we've received.
 void
 net_rxpullrq(net_pullrq *rq)
@@ -565,6 +1571,17 @@ net_rxpullrq(net_pullrq *rq)
 	// Send back whichever of the three page parts the caller still needs.
 	// (We must divide the page into parts to fit into Ethernet packets.)
 #if SOL >= 5
+#if LAB >= 9
+	// If the requester takes it, send a whole data page in one frame:
+	// as a delta against a version the requester holds, or just compressed.
+	if ((rq->need & 7) == 7 && rq->pglev == PGLEV_PAGE
+			&& (((rq->need & NET_PULLDOK)
+				&& net_txpulld(rqnode, rr, pi))
+			|| ((rq->need & NET_PULLZOK)
+				&& net_txpullz(rqnode, rr, pg,
+					rq->need & NET_PULLHOK))))
+		rq->need = 0;
+#endif
 	if (rq->need & 1) net_txpullrp(rqnode, rr, rq->pglev, 0, pg);
 	if (rq->need & 2) net_txpullrp(rqnode, rr, rq->pglev, 1, pg);
 	if (rq->need & 4) net_txpullrp(rqnode, rr, rq->pglev, 2, pg);
@@ -647,6 +1664,11 @@ net_txpullrp(uint8_t rqnode, uint32_t rr, int pglev, int part, void *pg)
 	rph.type = NET_PULLRP;
 	rph.rr = rr;
 	rph.part = part;
+#if LAB >= 9
+	if (data == pg + NET_PULLPART*part)	// not converted to RRs
+		net_txpage(&rph, sizeof(rph), data, len);
+	else
+#endif
 	net_tx(&rph, sizeof(rph), data, len);
 }
 
@@ -672,6 +1694,59 @@ net_rxpullrp(net_pullrphdr *rp, int len)
 		return spinlock_release(&net_lock);
 	}
 	int part = rp->part;
+#if LAB >= 9
+	if (part == NET_PULLZIP) {	// the whole page at once
+		if (p->pglev != PGLEV_PAGE || !net_unzip((uint8_t*) rp->data,
+					len - sizeof(*rp), p->pullpg)) {
+			warn("net_rxpullrp: bad compressed page");
+			p->arrived = 0;	// parts we had may be clobbered
+			return spinlock_release(&net_lock);
+		}
+		p->arrived = 7;
+		goto filled;
+	}
+	if (part == NET_PULLDELTA) {	// the whole page, as a delta
+		pageinfo *bpi = p->pglev == PGLEV_PAGE
+				? net_pullbase(rp->base) : NULL;
+		bool ok = bpi != NULL
+			&& net_sumeq(net_pagesum(mem_pi2ptr(bpi)), rp->sum)
+			&& net_unzip((uint8_t*) rp->data, len - sizeof(*rp),
+					p->pullpg);
+		if (ok) {
+			uint64_t *pw = p->pullpg;
+			const uint64_t *bw = mem_pi2ptr(bpi);
+			int i;
+			for (i = 0; i < PAGESIZE/8; i++)
+				pw[i] ^= bw[i];
+		}
+		if (bpi != NULL)
+			mem_decref(bpi, mem_free);
+		if (!ok) {	// ask again for the page in full
+			warn("net_rxpullrp: can't apply delta for RR %x",
+				rp->rr);
+			p->arrived = 0;
+			p->pullfull = true;
+			net_txpullrq(p);
+			return spinlock_release(&net_lock);
+		}
+		p->arrived = 7;
+		goto filled;
+	}
+	if (part == NET_PULLHASH) {	// just the page's content hash
+		pageinfo *lpi = p->pglev == PGLEV_PAGE
+				? net_sumfind(rp->sum) : NULL;
+		if (lpi == NULL) {	// we lack it: ask for the contents
+			p->pullhashed = true;
+			net_txpullrq(p);
+			return spinlock_release(&net_lock);
+		}
+		memcpy(p->pullpg, mem_pi2ptr(lpi), PAGESIZE);
+		mem_decref(lpi, mem_free);
+		net_zstat.hashhits++;
+		p->arrived = 7;
+		goto filled;
+	}
+#endif
 	if (part < 0 || part > 2) {
 		warn("net_rxpullrp: invalid part number %d", part);
 		return spinlock_release(&net_lock);
@@ -689,6 +1764,11 @@ net_rxpullrp(net_pullrphdr *rp, int len)
 	// Fill in the appropriate part of the page.
 	memcpy(p->pullpg + NET_PULLPART*part, rp->data, datalen);
 	p->arrived |= 1 << rp->part;	// Mark this part arrived.
+#if LAB >= 9
+filled:
+	if (p->arrived == 7 && p->pglev == PGLEV_PAGE)
+		net_suminsert(p->pullpg, net_pagesum(p->pullpg));
+#endif
 	if (p->arrived == 7)		// All three parts arrived?
 		*pp = p->pullnext;	// Remove from list of waiting procs.
 
@@ -796,6 +1876,11 @@ net_pullpte(proc *p, uint32_t *pte, int pglevel)
 	assert(pi->shared != 0);
 	assert(pi->home == rr);
 
+#if LAB >= 9
+	// A page pushed to us and still clean needn't be pulled at all.
+	if (pglevel == PGLEV_PAGE && net_mftake(rr, mem_pi2ptr(pi)))
+		return 1;
+#endif
 	net_pull(p, rr, mem_pi2ptr(pi), pglevel);	// go pull the page
 	return 0;	// Now must wait for pull to complete.
 #else	// ! SOL >= 5
@@ -817,6 +1902,421 @@ net_pullpte(proc *p, uint32_t *pte, int pglevel)
 #endif	// ! SOL >= 5
 }
 
+#if LAB >= 9
+// Pre-copy: while a process that asked with SYS_PRECOPY keeps running,
+// push its pages to the node it means to migrate to, a few per tick,
+// making passes over its address space until few pages are still dirty.
+// The destination keeps what it's pushed as content-hashed copies.
+// Once a whole pass has gone there, migrating sends a manifest first:
+// the hash of each page not written since, going by the dirty bit.
+// The destination fills those pages from its copies as it comes to them,
+// so only pages dirtied since they were pushed cost a round trip
+// while the process is stopped.
+#define NET_PUSHTICK	8	// Most pages pushed per tick, over all procs
+#define NET_PUSHSCAN	1024	// Most PTEs or empty regions scanned per tick
+#define NET_PUSHPASSES	4	// Most passes over a process's memory
+#define NET_PUSHFEW	16	// Stop after a pass that pushed fewer pages
+#define NET_PUSHCACHE	4096	// Pushed pages a destination holds at once
+#define NET_PUSHAGE	((uint64_t)TIMER_FREQ*60) // ... and for how long
+#define NET_MFFRAMES	(NET_MAXQUEUE/4)	// Most frames in one manifest
+#define NET_MFSLOTS	8192	// Manifest entries a destination holds
+
+static pageinfo *net_pushpg[NET_PUSHCACHE];	// Ring of pushed pages
+static uint64_t net_pushtime[NET_PUSHCACHE];	// When each one arrived
+static int net_pushnext;			// Slot the next one goes in
+
+// Pages pushed raw, being assembled from their parts.
+// A node's transport delivers in order and net_pushtick() sends
+// a page's three parts back to back, so one per node suffices.
+static struct net_pushasm {
+	pageinfo	*pi;
+	net_sum		sum;
+	uint8_t		arrived;
+} net_pushasm[NET_MAXNODES+1];
+
+// Manifest entries received, direct-mapped by RR:
+// our local page with the contents each RR names, with a reference held.
+static uint32_t net_mfrr[NET_MFSLOTS];		// RR without perms, or 0
+static pageinfo *net_mfpg[NET_MFSLOTS];
+static uint64_t net_mftime[NET_MFSLOTS];	// When it arrived
+
+// Start pushing p's memory to node ahead of migrating there,
+// starting over if it was already pushing to some other node.
+void
+net_precopy(proc *p, uint8_t node)
+{
+	assert(node > 0 && node <= NET_MAXNODES && node != net_node);
+
+	spinlock_acquire(&net_lock);
+	if (p->pushdest != node) {
+		if (p->pushdest == 0) {
+			p->pushnext = net_pushlist;
+			net_pushlist = p;
+		}
+		p->pushdest = node;
+		p->pushpass = 0;
+		p->pushed = 0;
+		p->pushva = VM_USERLO;
+		if (p->pushedto != node)
+			p->pushedto = 0;
+	}
+	spinlock_release(&net_lock);
+}
+
+// Find the PTE mapping va in pml4 without creating anything;
+// if no page table covers va, advance va past the region with none.
+static pte_t *
+net_pushwalk(pte_t *pml4, intptr_t *va)
+{
+	pte_t *t = pml4;
+	int l;
+	for (l = NPTLVLS; l > 0; l--) {
+		pte_t pde = t[PDX(l, *va)];
+		if (PTE_ADDR(pde) == PTE_ZERO || (pde & PTE_REMOTE)) {
+			*va = PDADDR(l, *va) + PDSIZE(l);
+			return NULL;
+		}
+		t = mem_ptr(PTE_ADDR(pde));
+	}
+	return &t[PDX(0, *va)];
+}
+
+// Push one page, which mustn't change under us, with content hash sum:
+// compressed in one frame if it fits, else as three raw parts.
+// ztab is a scratch page for the compressor.
+static void
+net_txpush(uint8_t node, void *pg, net_sum sum, void *ztab)
+{
+	uint16_t *htab = ztab;
+	uint8_t *zbuf = (uint8_t*) (htab + NET_ZHASH);
+	int zlen = net_zip(pg, zbuf, NET_ZMAX, htab);
+
+	net_pushhdr ph;
+	net_ethsetup(&ph.eth, node);
+	ph.type = NET_PUSH;
+	ph.sum = sum;
+	if (zlen >= 0) {
+		ph.part = NET_PULLZIP;
+		net_tx(&ph, sizeof(ph), zbuf, zlen);
+		return;
+	}
+	for (ph.part = 0; ph.part < 3; ph.part++)
+		net_tx(&ph, sizeof(ph), pg + NET_PULLPART*ph.part,
+			partlen[ph.part]);
+}
+
+// Find pre-copying process p's next page to push and copy it into copy,
+// scanning at most *scan PTEs.  Returns the node to push it to,
+// 0 if there's none to push just now, or -1 once p is done pre-copying.
+static int
+net_pushone(proc *p, void *copy, int *scan)
+{
+	assert(spinlock_holding(&net_lock));
+
+	// Its page tables are only ours to look at if it isn't running,
+	// or if it's running here and we interrupted it in user mode.
+	// Nor if it's stopped: its parent may be editing them meanwhile
+	// via do_put() or do_get(), which don't take the child's lock.
+	// Check before locking, then again after; and since others take
+	// p->lock before net_lock, never wait for it: try next tick instead.
+	if (p->state == PROC_STOP
+			|| (p->state == PROC_RUN && p->runcpu != cpu_cur()))
+		return 0;
+	if (!spinlock_try(&p->lock))
+		return 0;
+	if (p->state == PROC_STOP
+			|| (p->state == PROC_RUN && p->runcpu != cpu_cur())) {
+		spinlock_release(&p->lock);
+		return 0;
+	}
+
+	uint8_t node = p->pushdest;
+	while (*scan > 0 && net_peers[node].ntxq < NET_MAXQUEUE/2) {
+		(*scan)--;
+		if (p->pushva >= VM_USERHI) {	// finished a pass
+			p->pushedto = node;
+			if (++p->pushpass >= NET_PUSHPASSES
+					|| p->pushed < NET_PUSHFEW) {
+				spinlock_release(&p->lock);
+				return -1;	// the rest can wait for pulls
+			}
+			p->pushva = VM_USERLO;
+			p->pushed = 0;
+			continue;
+		}
+		pte_t *pte = net_pushwalk(p->pml4, &p->pushva);
+		if (pte == NULL)
+			continue;
+		intptr_t va = p->pushva;
+		p->pushva += PAGESIZE;
+
+		// After the first pass, push only pages written since,
+		// going by the dirty bit the processor sets in the PTE.
+		if (!(*pte & PTE_P) || PTE_ADDR(*pte) == PTE_ZERO
+				|| (p->pushpass > 0 && !(*pte & PTE_D)))
+			continue;
+		*pte &= ~PTE_D;
+		pmap_inval(p->pml4, va, PAGESIZE);
+
+		memcpy(copy, mem_ptr(PTE_ADDR(*pte)), PAGESIZE);
+		p->pushed++;
+		spinlock_release(&p->lock);
+		return node;
+	}
+	spinlock_release(&p->lock);
+	return 0;
+}
+
+// Called every tick: push a few pages of the pre-copying processes,
+// taking them in turn and leaving room in the transport's queue
+// for the peer's other traffic.
+// Only finding and copying each page happens under net_lock;
+// hashing, compressing and sending it don't.
+static void
+net_pushtick(void)
+{
+	if (net_pushlist == NULL)	// unlocked peek; next tick will do
+		return;
+
+	pageinfo *cpi = mem_alloc(), *zpi = mem_alloc();
+	if (cpi == NULL || zpi == NULL) {
+		if (cpi != NULL) mem_free(cpi);
+		if (zpi != NULL) mem_free(zpi);
+		return;
+	}
+	assert(NET_ZHASH * sizeof(uint16_t) + NET_ZMAX <= PAGESIZE);
+	void *copy = mem_pi2ptr(cpi);
+
+	int n, scan = NET_PUSHSCAN;
+	for (n = 0; n < NET_PUSHTICK && scan > 0; n++) {
+		spinlock_acquire(&net_lock);
+		proc *p = net_pushlist;
+		if (p == NULL) {
+			spinlock_release(&net_lock);
+			break;
+		}
+		int node = net_pushone(p, copy, &scan);
+
+		// Move p to the tail of the list, or drop it once done.
+		net_pushlist = p->pushnext;
+		p->pushnext = NULL;
+		if (node >= 0) {
+			proc **pp = &net_pushlist;
+			while (*pp != NULL)
+				pp = &(*pp)->pushnext;
+			*pp = p;
+		} else
+			p->pushdest = 0;
+		spinlock_release(&net_lock);
+
+		if (node > 0) {
+			net_sum sum = net_pagesum(copy);
+			net_txpush(node, copy, sum, mem_pi2ptr(zpi));
+			spinlock_acquire(&net_lock);
+			net_sentnote(sum, node);
+			spinlock_release(&net_lock);
+		}
+	}
+	mem_free(cpi);
+	mem_free(zpi);
+}
+
+// Just before p migrates to node, to which a whole pre-copy pass has gone,
+// send node the RRs and hashes of the pages p hasn't written since,
+// in as few frames as they fit in.  Any the destination lacks after all,
+// it just pulls.  p is the current process, so its page tables are ours.
+static void
+net_txmanifest(proc *p, uint8_t node)
+{
+	pageinfo *epi = mem_alloc();
+	if (epi == NULL)
+		return;
+	net_mfent *ent = mem_pi2ptr(epi);
+	assert(NET_MFMAX * sizeof(net_mfent) <= PAGESIZE);
+
+	net_manifest mf;
+	net_ethsetup(&mf.eth, node);
+	mf.type = NET_MANIFEST;
+	mf.n = 0;
+
+	int frames = 0;
+	intptr_t va = VM_USERLO;
+	while (va < VM_USERHI && frames < NET_MFFRAMES
+			&& net_peers[node].ntxq < NET_MAXQUEUE*3/4) {
+		pte_t *pte = net_pushwalk(p->pml4, &va);
+		if (pte == NULL)
+			continue;
+		va += PAGESIZE;
+		if (!(*pte & PTE_P) || (*pte & PTE_D)
+				|| PTE_ADDR(*pte) == PTE_ZERO)
+			continue;
+		pageinfo *pi = mem_phys2pi(PTE_ADDR(*pte));
+		if (pi->home != 0)
+			continue;	// not ours to vouch for
+
+		// The destination will hold a copy by this RR from now on.
+		net_rrshare(mem_pi2ptr(pi), node);
+		ent[mf.n].rr = RRCONS(net_node, mem_pi2phys(pi), 0);
+		ent[mf.n].sum = net_pagesum(mem_pi2ptr(pi));
+		if (++mf.n == NET_MFMAX) {
+			net_tx(&mf, sizeof(mf), ent, mf.n * sizeof(net_mfent));
+			mf.n = 0;
+			frames++;
+		}
+	}
+	if (mf.n > 0)
+		net_tx(&mf, sizeof(mf), ent, mf.n * sizeof(net_mfent));
+	mem_free(epi);
+}
+
+// Note the pages a migrating process's manifest names that we already
+// hold copies of, so net_pullpte() can use them instead of pulling.
+static void
+net_rxmanifest(net_manifest *mf, int len)
+{
+	assert(mf->type == NET_MANIFEST);
+	uint8_t node = mf->eth.src[5];
+	assert(node > 0 && node <= NET_MAXNODES && node != net_node);
+	if (mf->n < 0 || mf->n > NET_MFMAX
+			|| len < sizeof(*mf) + mf->n * sizeof(net_mfent)) {
+		warn("net_rxmanifest: bad length %d for %d entries",
+			len, mf->n);
+		return;
+	}
+
+	spinlock_acquire(&net_lock);
+	uint64_t now = timer_read();
+	int i;
+	for (i = 0; i < mf->n; i++) {
+		uint32_t rr = mf->ent[i].rr & ~RR_RW;
+		if (RRNODE(rr) != node)
+			continue;	// it can only vouch for its own pages
+		pageinfo *pi = net_sumfind(mf->ent[i].sum);
+		if (pi == NULL)
+			continue;	// we'll have to pull this one
+		int s = (RRADDR(rr) / PAGESIZE) % NET_MFSLOTS;
+		if (net_mfpg[s] != NULL)
+			mem_decref(net_mfpg[s], mem_free);
+		net_mfrr[s] = rr;
+		net_mfpg[s] = pi;	// net_sumfind() gave us a reference
+		net_mftime[s] = now;
+	}
+	spinlock_release(&net_lock);
+}
+
+// If a manifest said our copy of the page rr names is still current,
+// fill pg from it and return true.  Each entry serves just once.
+static bool
+net_mftake(uint32_t rr, void *pg)
+{
+	rr &= ~RR_RW;
+	int s = (RRADDR(rr) / PAGESIZE) % NET_MFSLOTS;
+
+	spinlock_acquire(&net_lock);
+	pageinfo *pi = net_mfrr[s] == rr ? net_mfpg[s] : NULL;
+	if (pi != NULL) {
+		net_mfrr[s] = 0;
+		net_mfpg[s] = NULL;
+		net_zstat.mfhits++;
+	}
+	spinlock_release(&net_lock);
+	if (pi == NULL)
+		return false;
+
+	memcpy(pg, mem_pi2ptr(pi), PAGESIZE);
+	mem_decref(pi, mem_free);
+	return true;
+}
+
+// Keep a pushed page, whose contents we've checked against sum,
+// where manifests and hash-first pulls will find it,
+// displacing the oldest one.
+static void
+net_pushkeep(pageinfo *pi, net_sum sum)
+{
+	assert(spinlock_holding(&net_lock));
+	mem_incref(pi);
+	if (net_pushpg[net_pushnext] != NULL)
+		mem_decref(net_pushpg[net_pushnext], mem_free);
+	net_pushpg[net_pushnext] = pi;
+	net_pushtime[net_pushnext] = timer_read();
+	net_pushnext = (net_pushnext + 1) % NET_PUSHCACHE;
+	net_suminsert(mem_pi2ptr(pi), sum);
+}
+
+// Drop pushed pages and manifest entries
+// we've held too long for the migration to come.
+static void
+net_pushexpire(uint64_t now)
+{
+	assert(spinlock_holding(&net_lock));
+	int i;
+	for (i = 0; i < NET_PUSHCACHE; i++)
+		if (net_pushpg[i] != NULL
+				&& now - net_pushtime[i] > NET_PUSHAGE) {
+			mem_decref(net_pushpg[i], mem_free);
+			net_pushpg[i] = NULL;
+		}
+	for (i = 0; i < NET_MFSLOTS; i++)
+		if (net_mfpg[i] != NULL
+				&& now - net_mftime[i] > NET_PUSHAGE) {
+			mem_decref(net_mfpg[i], mem_free);
+			net_mfpg[i] = NULL;
+			net_mfrr[i] = 0;
+		}
+}
+
+static void
+net_rxpush(net_pushhdr *ph, int len)
+{
+	assert(ph->type == NET_PUSH);
+	uint8_t node = ph->eth.src[5];
+	assert(node > 0 && node <= NET_MAXNODES && node != net_node);
+	int datalen = len - sizeof(*ph);
+
+	spinlock_acquire(&net_lock);
+	struct net_pushasm *a = &net_pushasm[node];
+	pageinfo *pi = NULL;
+	if (ph->part == NET_PULLZIP) {
+		pi = mem_alloc();
+		if (pi != NULL && !net_unzip((uint8_t*)ph->data, datalen,
+						mem_pi2ptr(pi))) {
+			warn("net_rxpush: bad compressed page");
+			mem_free(pi);
+			pi = NULL;
+		}
+	} else if (ph->part >= 0 && ph->part < 3
+			&& datalen == partlen[ph->part]) {
+		if (a->pi == NULL || !net_sumeq(a->sum, ph->sum)) {
+			if (a->pi == NULL)
+				a->pi = mem_alloc();
+			a->sum = ph->sum;
+			a->arrived = 0;
+		}
+		if (a->pi != NULL) {
+			memcpy(mem_pi2ptr(a->pi) + NET_PULLPART*ph->part,
+				ph->data, datalen);
+			a->arrived |= 1 << ph->part;
+			if (a->arrived == 7) {
+				pi = a->pi;
+				a->pi = NULL;
+			}
+		}
+	} else
+		warn("net_rxpush: bad part %d (%d bytes)", ph->part, datalen);
+
+	if (pi != NULL) {
+		if (net_sumeq(net_pagesum(mem_pi2ptr(pi)), ph->sum))
+			net_pushkeep(pi, ph->sum);
+		else {
+			warn("net_rxpush: page doesn't match its hash");
+			mem_free(pi);
+		}
+	}
+	spinlock_release(&net_lock);
+}
+#endif	// LAB >= 9
+
 // send to remote node
 void gcc_noreturn
 net_send(struct trapframe *tf, uint64_t msgid, intptr_t srcaddr, intptr_t dstaddr, size_t size)
@@ -1101,6 +2601,11 @@ net_rxrecvrp(net_recvrp *rp)
 	cp->remotelimit = rp->dstaddr + rp->size;
 	cp->pullva = rp->srcaddr;
 	cp->arrived = 0;
+#if LAB >= 9
+	cp->fetchwin = 1;
+	cp->fetchsent = 0;
+	memset(cp->fetched, 0, sizeof(cp->fetched));
+#endif
 
 	net_txfetchrq(cp);
 
@@ -1138,9 +2643,30 @@ net_txfetchrq(proc *cp)
 	rq.type = NET_FETCHRQ;
 	rq.srcid = cp->remoteid;
 	rq.dstid = ((uint64_t)net_node << 56) | cp->mid;
+#if LAB >= 9
+	// Keep up to fetchwin pages of the message requested at once,
+	// skipping pages whose parts have all arrived already.
+	// Once everything has, ask for the page at the sender's limit,
+	// which tells it we're done.
+	if (cp->remoteva == cp->remotelimit) {
+		rq.srcaddr = cp->pullva;
+		rq.need = 0x7;
+		net_tx(&rq, sizeof(rq), NULL, 0);
+		return;
+	}
+	int win = MIN(cp->fetchwin, (cp->remotelimit - cp->remoteva) / PAGESIZE);
+	for (; cp->fetchsent < win; cp->fetchsent++) {
+		rq.srcaddr = cp->pullva + cp->fetchsent * PAGESIZE;
+		rq.need = cp->fetched[rq.srcaddr / PAGESIZE % PROC_FETCHAHEAD]
+				^ 0x7;
+		if (rq.need != 0)
+			net_tx(&rq, sizeof(rq), NULL, 0);
+	}
+#else
 	rq.srcaddr = cp->pullva;
 	rq.need = cp->arrived ^ 0x7;
 	net_tx(&rq, sizeof(rq), NULL, 0);
+#endif
 }
 
 void
@@ -1205,7 +2731,11 @@ net_txfetchrp(proc *p, intptr_t srcaddr, int8_t part)
 		void *ptr = mem_ptr(PTE_ADDR(*pte)) + NET_PULLPART * part;
 		int len = partlen[part];
 		assert(len <= NET_PULLPART);
+#if LAB >= 9
+		net_txpage(&rp, sizeof(rp), ptr, len);
+#else
 		net_tx(&rp, sizeof(rp), ptr, len);
+#endif
 	} else {
 		rp.part = -1;
 		net_tx(&rp, sizeof(rp), NULL, 0);
@@ -1234,6 +2764,42 @@ net_rxfetchrp(net_fetchrp *rp, int len)
 	if (cp->state != PROC_RECV || cp->remoteid != rp->srcid)
 		goto exit;
 //	cprintf("[net_rxfetchrp] pullva %p\n", cp->pullva);
+#if LAB >= 9
+	if (rp->part == -1 && rp->srcaddr == cp->pullva
+			&& cp->remoteva == cp->remotelimit)
+		goto wake;
+	if (rp->part == -1 || rp->srcaddr < cp->pullva
+			|| rp->srcaddr >= cp->pullva + cp->fetchsent * PAGESIZE)
+		goto exit;	// not a page we have asked for
+
+	// Pages may complete out of order; we move on from each page
+	// once it and all before it have arrived.
+	// A message copied this way is a sequential stream,
+	// so each page done widens the window by one,
+	// doubling it every round trip until it reaches PROC_FETCHAHEAD.
+	uint8_t *fp = &cp->fetched[rp->srcaddr / PAGESIZE % PROC_FETCHAHEAD];
+	if (*fp & (1 << rp->part))
+		goto exit;
+	len -= sizeof(*rp);
+	if (len != partlen[rp->part])
+		goto exit;
+	pte_t *pte = pmap_walk(cp->pml4,
+			cp->remoteva + (rp->srcaddr - cp->pullva), 1);
+	void *ptr = mem_ptr(PTE_ADDR(*pte)) + NET_PULLPART * rp->part;
+	memcpy(ptr, rp->data, len);
+	*fp |= 1 << rp->part;
+	while (cp->fetchsent > 0) {
+		fp = &cp->fetched[cp->pullva / PAGESIZE % PROC_FETCHAHEAD];
+		if (*fp != 0x7)
+			break;
+		*fp = 0;
+		cp->pullva += PAGESIZE;
+		cp->remoteva += PAGESIZE;
+		cp->fetchsent--;
+		cp->fetchwin = MIN(cp->fetchwin + 1, PROC_FETCHAHEAD);
+	}
+	net_txfetchrq(cp);
+#else
 	if (rp->srcaddr != cp->pullva)
 		goto exit;
 	if (rp->part == -1 && cp->remoteva == cp->remotelimit)
@@ -1259,6 +2825,7 @@ net_rxfetchrp(net_fetchrp *rp, int len)
 		cp->arrived = 0;
 		net_txfetchrq(cp);
 	}
+#endif
 exit:
 	spinlock_release(&cp->lock);
 	return;
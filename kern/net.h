@@ -32,6 +32,22 @@ typedef struct net_ethhdr {
 
 #define NET_MAXNODES	32		// Max number of nodes in system
 
+#if LAB >= 9
+// Transport header, which net_tx() slips in between the Ethernet header
+// and the message proper, and net_rx() strips off again.
+typedef struct net_xhdr {
+	uint32_t	epoch;	// Sender's boot epoch, to notice peer restarts
+	uint32_t	seq;	// Frame's sequence number, 0 for a pure ack
+	uint32_t	ack;	// Next sequence number expected from receiver
+	uint32_t	wnd;	// Frames sender has room to receive; 0 = unsaid
+} net_xhdr;
+
+#ifndef NET_WINDOW
+#define NET_WINDOW	16		// Default send window, in frames
+#endif
+#define NET_MAXQUEUE	256		// Max frames queued for one peer
+#endif
+
 #if LAB >= 99
 // Internet Protocol (IP) header - see RFC791
 typedef struct net_iphdr {
@@ -89,6 +105,10 @@ typedef enum net_msgtype {
 	NET_RECVRP,
 	NET_FETCHRQ,
 	NET_FETCHRP,
+#if LAB >= 9
+	NET_PUSH,		// Page pushed ahead of a migration
+	NET_MANIFEST,		// Hashes of pushed pages still clean at migration
+#endif
 } net_msgtype;
 
 // Minimal packet header for all our network messages
@@ -111,6 +131,14 @@ typedef struct net_migrp {
 	intptr_t	home;	// Remote ref for proc being acknowledged
 } net_migrp;
 
+#if LAB >= 9
+// 128-bit content hash of a page, as computed by net_pagesum()
+typedef struct net_sum {
+	uint64_t	lo;
+	uint64_t	hi;
+} net_sum;
+#endif
+
 // Pull a page from a remote node
 typedef struct net_pullrq {
 	net_ethhdr	eth;
@@ -119,6 +147,11 @@ typedef struct net_pullrq {
 	uint8_t		pglev;	// 0=page, 1=page table, 2=page directory
 	uint8_t		need;	// Bits 2-0: which parts of page are needed
 } net_pullrq;
+#if LAB >= 9
+#define NET_PULLZOK	0x08	// need: requester takes a compressed reply
+#define NET_PULLDOK	0x10	// need: requester takes a delta reply
+#define NET_PULLHOK	0x20	// need: requester takes just a content hash
+#endif
 
 // Page pull reply - 3 required per page, to fit in Ethernet packet size.
 #define NET_PULLPART	1368		// 1368*3 >= 4096
@@ -130,8 +163,59 @@ typedef struct net_pullrphdr {
 	net_msgtype	type;	// = NET_PULLRP
 	intptr_t	rr;	// Remote reference
 	int		part;	// Which part of the page this is: 0, 1, or 2
+#if LAB >= 9
+	uint32_t	base;	// NET_PULLDELTA: RR of the version diffed against
+	net_sum		sum;	// net_pagesum() of base, or page for NET_PULLHASH
+#endif
 	char		data[0]; // Variable-length payload follows pullrphdr
 } net_pullrphdr;
+#if LAB >= 9
+#define NET_PULLZIP	3	// part: the whole page, compressed
+#define NET_PULLDELTA	4	// part: page XOR base page, compressed
+#define NET_PULLHASH	5	// part: no data, just the page's content hash
+#define NET_ZMAX	(NET_MAXPKT - sizeof(net_xhdr) - sizeof(net_pullrphdr))
+
+// Counters for page compression on the pull wire.
+// The achieved ratio is wirebytes/rawbytes.
+typedef struct net_zstats {
+	uint64_t	pages;		// Whole data pages we've replied with
+	uint64_t	zpages;		// ... of which we sent compressed
+	uint64_t	dpages;		// ... of which as deltas
+	uint64_t	rawbytes;	// Their size uncompressed
+	uint64_t	wirebytes;	// ... and the page bytes actually sent
+	uint64_t	hashes;		// Pages we offered by hash first
+	uint64_t	hashhits;	// Pages we found locally by hash
+	uint64_t	mfhits;		// Pages a manifest let us skip pulling
+} net_zstats;
+#endif
+
+#if LAB >= 9
+// Page pushed unasked to the node a process is about to migrate to,
+// which keeps it as a local copy that it can find by hash.
+typedef struct net_pushhdr {
+	net_ethhdr	eth;
+	net_msgtype	type;	// = NET_PUSH
+	int		part;	// 0-2 as for pulls, or NET_PULLZIP
+	net_sum		sum;	// net_pagesum() of the whole page
+	char		data[0];
+} net_pushhdr;
+
+// Sent just ahead of a migrate request: the RRs and content hashes
+// of pages the process hasn't written since they were last pushed,
+// so the destination can fill those from its copies without pulling.
+typedef struct net_mfent {
+	uint32_t	rr;	// The page's RR, as the process's ptabs will have
+	net_sum		sum;	// net_pagesum() of its contents
+} net_mfent;
+typedef struct net_manifest {
+	net_ethhdr	eth;
+	net_msgtype	type;	// = NET_MANIFEST
+	int		n;	// Entries that follow
+	net_mfent	ent[0];
+} net_manifest;
+#define NET_MFMAX	((NET_MAXPKT - sizeof(net_xhdr) \
+				- sizeof(net_manifest)) / sizeof(net_mfent))
+#endif
 
 typedef struct net_sendrq {
 	net_ethhdr	eth;
@@ -214,6 +298,10 @@ typedef struct net_fetchrp {
 
 extern uint8_t net_node;	// My node number - from net_mac[5]
 extern uint8_t net_mac[6];	// My MAC address from the Ethernet card
+#if LAB >= 9
+extern int net_window;		// Unacked frames allowed in flight per peer
+extern net_zstats net_zstat;	// Page compression counters
+#endif
 
 struct trapframe;
 
@@ -223,6 +311,13 @@ void net_tick(void);
 void gcc_noreturn net_migrate(struct trapframe *tf, uint8_t node, int entry);
 void gcc_noreturn net_send(struct trapframe *tf, uint64_t msgid, intptr_t srcaddr, intptr_t dstaddr, size_t size);
 void gcc_noreturn net_recv(struct trapframe *tf, uint64_t msgid);
+#if LAB >= 9
+struct pageinfo;
+void net_setbase(struct pageinfo *pi, struct pageinfo *opi);
+void net_txready(void);
+struct proc;
+void net_precopy(struct proc *p, uint8_t node);
+#endif
 
 #endif // !PIOS_KERN_NET_H
 #endif // LAB >= 2
@@ -24,6 +24,9 @@
 #include <kern/trap.h>
 #include <kern/proc.h>
 #include <kern/pmap.h>
+#if LAB >= 9
+#include <kern/net.h>
+#endif
 
 // Statically allocated page directory mapping the kernel's address space.
 // We use this as a template for all pdirs for user-level processes.
@@ -565,22 +568,91 @@ pmap_copy(pte_t *spml4, intptr_t sva, pte_t *dpml4, intptr_t dva,
 	pmap_inval(dpml4, dva, size);
 
 	intptr_t svahi = sva + size;
-	pmap_copy_level(NPTLVLS, spml4, sva, dpml4, dva, svahi);
+	pmap_copy_level(NPTLVLS, spml4, sva, dpml4, NULL, dva, svahi);
 	return 1;
 #else /* not SOL >= 3 */
 	panic("pmap_copy() not implemented");
 #endif /* not SOL >= 3 */
 }
 
+#if SOL >= 3
+//
+// Like pmap_copy, but also installs the same mappings at dva in rpml4
+// during the same walk of the source tables,
+// so a PUT with both SYS_COPY and SYS_SNAP doesn't walk the tree twice.
+// Only [dva,dva+size) of rpml4 is touched.
+//
+int
+pmap_copysnap(pte_t *spml4, intptr_t sva, pte_t *dpml4, pte_t *rpml4,
+		intptr_t dva, size_t size)
+{
+	assert(PDOFF(0, sva) == 0);	// must be 4KB-aligned
+	assert(PDOFF(0, dva) == 0);
+	assert(PDOFF(0, size) == 0);
+	assert(sva >= VM_USERLO && sva < VM_USERHI);
+	assert(dva >= VM_USERLO && dva < VM_USERHI);
+	assert(size <= VM_USERHI - sva);
+	assert(size <= VM_USERHI - dva);
+
+	pmap_inval(spml4, sva, size);
+	pmap_inval(dpml4, dva, size);
+
+	pmap_copy_level(NPTLVLS, spml4, sva, dpml4, rpml4, dva, sva + size);
+	return 1;
+}
+
+//
+// Return true if apml4 and bpml4 map exactly the same pages
+// with the same nominal permissions over [va,va+size).
+// Tables shared by both are identical by construction,
+// so this only descends into the few tables that aren't shared.
+//
+static bool pmap_same_level();
+
+bool
+pmap_same(pte_t *apml4, pte_t *bpml4, intptr_t va, size_t size)
+{
+	return pmap_same_level(NPTLVLS, apml4, bpml4, va, va + size);
+}
+
+static bool
+pmap_same_level(int pmlevel, pte_t *apmtab, pte_t *bpmtab,
+		uintptr_t va, uintptr_t vahi)
+{
+	const pte_t ign = PTE_W | PTE_A | PTE_D;
+	while (va < vahi) {
+		pte_t a = apmtab[PDX(pmlevel, va)];
+		pte_t b = bpmtab[PDX(pmlevel, va)];
+		uintptr_t lvahi = PDADDR(pmlevel, va) + PDSIZE(pmlevel);
+		if (lvahi > vahi || lvahi == 0)
+			lvahi = vahi;
+		if ((a & ~ign) != (b & ~ign)) {
+			if (pmlevel == 0 || PTE_ADDR(a) == PTE_ADDR(b)
+					|| PTE_ADDR(a) == PTE_ZERO
+					|| PTE_ADDR(b) == PTE_ZERO)
+				return 0;
+			if (!pmap_same_level(pmlevel - 1,
+					mem_ptr(PTE_ADDR(a)),
+					mem_ptr(PTE_ADDR(b)), va, lvahi))
+				return 0;
+		}
+		va = lvahi;
+	}
+	return 1;
+}
+#endif	// SOL >= 3
+
 //
 // pmlevel == 3, spmtab & dpmtab => source/destination pml4 table
 // pmlevel == 2, spmtab & dpmtab => source/destination pdp table
 // pmlevel == 1, spmtab & dpmtab => source/destination page directory table
 // pmlevel == 0, spmtab & dpmtab => source/destination page table
+// If rpmtab is non-NULL, the mappings are also copied into it at dva,
+// so that it becomes a reference snapshot of the new destination.
 //
 static void
 pmap_copy_level(int pmlevel, pte_t *spmtab, intptr_t sva, pte_t *dpmtab, 
-		intptr_t dva, intptr_t svahi)
+		pte_t *rpmtab, intptr_t dva, intptr_t svahi)
 {
 //int i;
 	if (sva >= svahi)
@@ -590,6 +662,7 @@ pmap_copy_level(int pmlevel, pte_t *spmtab, intptr_t sva, pte_t *dpmtab,
 
 	pte_t *spmte = &spmtab[PDX(pmlevel, sva)];
 	pte_t *dpmte = &dpmtab[PDX(pmlevel, dva)];
+	pte_t *rpmte = rpmtab ? &rpmtab[PDX(pmlevel, dva)] : NULL;
 
 	while (sva < svahi) {
 		if (PDOFF(pmlevel, sva) == 0 && PDOFF(pmlevel, dva) == 0 && svahi - sva >= PDSIZE(pmlevel)) {
@@ -609,6 +682,16 @@ pmap_copy_level(int pmlevel, pte_t *spmtab, intptr_t sva, pte_t *dpmtab,
 				mem_incref(mem_phys2pi(PTE_ADDR(*spmte)));
 			}
 
+			// snapshot gets the very same mapping
+			if (rpmte) {
+				if (PTE_ADDR(*rpmte) != PTE_ZERO)
+					pmap_remove_level(pmlevel, rpmtab, dva, dva + PDSIZE(pmlevel));
+				*rpmte = *spmte;
+				if (PTE_ADDR(*spmte) != PTE_ZERO)
+					mem_incref(mem_phys2pi(PTE_ADDR(*spmte)));
+				rpmte++;
+			}
+
 			spmte++, dpmte++;
 			sva += PDSIZE(pmlevel);
 			dva += PDSIZE(pmlevel);
@@ -633,6 +716,8 @@ pmap_copy_level(int pmlevel, pte_t *spmtab, intptr_t sva, pte_t *dpmtab,
 		if (PTE_ADDR(*spmte) == PTE_ZERO) {
 			// source is invalid, remove dest as well
 			pmap_remove_level(pmlevel, dpmtab, dva, dva + size);
+			if (rpmtab)
+				pmap_remove_level(pmlevel, rpmtab, dva, dva + size);
 		} else {
 			// source is valid, copy it
 			// we must guarantee that lower-level table exists
@@ -640,7 +725,15 @@ pmap_copy_level(int pmlevel, pte_t *spmtab, intptr_t sva, pte_t *dpmtab,
 				pmap_walk_level(pmlevel, dpmtab, dva, 1);
 			}
 			assert(PTE_ADDR(*dpmte) != PTE_ZERO);
-			pmap_copy_level(pmlevel - 1, mem_ptr(PTE_ADDR(*spmte)), sva, mem_ptr(PTE_ADDR(*dpmte)), dva, sva + size);
+			pte_t *rlpmtab = NULL;
+			if (rpmtab) {
+				// snapshot tables are often shared: unshare first
+				if (!(*rpmte & PTE_W))
+					pmap_walk_level(pmlevel, rpmtab, dva, 1);
+				assert(PTE_ADDR(*rpmte) != PTE_ZERO);
+				rlpmtab = mem_ptr(PTE_ADDR(*rpmte));
+			}
+			pmap_copy_level(pmlevel - 1, mem_ptr(PTE_ADDR(*spmte)), sva, mem_ptr(PTE_ADDR(*dpmte)), rlpmtab, dva, sva + size);
 		}
 		dva += size;
 		sva += size;
@@ -650,10 +743,95 @@ pmap_copy_level(int pmlevel, pte_t *spmtab, intptr_t sva, pte_t *dpmtab,
 		}
 		if (PDOFF(pmlevel, dva) == 0) {
 			dpmte++;
+			if (rpmte)
+				rpmte++;
 		}
 	}
 }
 
+#if SOL >= 3
+//
+// Give a present, nominally read/write but copy-on-write page
+// its own writable copy (or just write access if it's not shared).
+//
+static void
+pmap_cowpage(pte_t *pte)
+{
+	// Find the "shared" page.  If refcount is 1, we have the only ref!
+	intptr_t pg = PTE_ADDR(*pte);
+	if (pg == PTE_ZERO || mem_phys2pi(pg)->refcount > 1) {
+		pageinfo *npi = mem_alloc(); assert(npi);
+		mem_incref(npi);
+		intptr_t npg = mem_pi2phys(npi);
+		memmove((void*)npg, (void*)pg, PAGESIZE); // copy the page
+		if (pg != PTE_ZERO) {
+#if LAB >= 9
+			net_setbase(npi, mem_phys2pi(pg));
+#endif
+			mem_decref(mem_phys2pi(pg), mem_free); // drop old ref
+		}
+		pg = npg;
+	}
+	*pte = pg | SYS_RW | PTE_A | PTE_D | PTE_W | PTE_U | PTE_P;
+}
+#if LAB >= 9
+
+// If the page at va is copy-on-write, resolve it now as if written.
+// Returns false if it's unmapped or lacks nominal write permission.
+// The caller is responsible for invalidating the TLB.
+static bool
+pmap_prewrite_page(pte_t *pml4, uintptr_t va)
+{
+	if (va < VM_USERLO || va >= VM_USERHI)
+		return 0;
+	pte_t *pte = pmap_walk(pml4, va, 0);
+	if (pte == NULL || (*pte & (SYS_READ | SYS_WRITE | PTE_P))
+			!= (SYS_READ | SYS_WRITE | PTE_P))
+		return 0;
+
+	// The PTE may look writable but live in a shared page table;
+	// walking for write unshares the tables and clears PTE_W if so.
+	pte = pmap_walk(pml4, va, 1);
+	if (pte == NULL)
+		return 0;
+	if (!(*pte & PTE_W))
+		pmap_cowpage(pte);
+	return 1;
+}
+#endif	// LAB >= 9
+#endif	// SOL >= 3
+#if LAB >= 9
+
+//
+// Resolve all copy-on-write pages in [va,va+size) ahead of time,
+// so the caller won't take a write fault on each of them later.
+// Pages without nominal read/write permission are left alone.
+//
+void
+pmap_prewrite(pte_t *pml4, intptr_t va, size_t size)
+{
+	assert(PDOFF(0, va) == 0);
+	assert(PDOFF(0, size) == 0);
+	assert(va >= VM_USERLO && va < VM_USERHI);
+	assert(size <= VM_USERHI - va);
+
+#if SOL >= 3
+	intptr_t vahi = va + size;
+	while (va < vahi) {
+		if (pmap_walk(pml4, va, 0) == NULL) {
+			va = PDADDR(1, va) + PDSIZE(1);	// no page table here
+			continue;
+		}
+		pmap_prewrite_page(pml4, va);
+		va += PAGESIZE;
+	}
+	pmap_inval(pml4, vahi - size, size);
+#else /* not SOL >= 3 */
+	panic("pmap_prewrite() not implemented");
+#endif /* not SOL >= 3 */
+}
+#endif	// LAB >= 9
+
 //
 // Transparently handle a page fault entirely in the kernel, if possible.
 // If the page fault was caused by a write to a copy-on-write page,
@@ -694,22 +872,27 @@ pmap_pagefault(trapframe *tf)
 		return;		// page doesn't exist at all - blame user
 	}
 	assert(!(*pte & PTE_W));
+	pmap_cowpage(pte);
+	size_t size = PAGESIZE;
 
-	// Find the "shared" page.  If refcount is 1, we have the only ref!
-	intptr_t pg = PTE_ADDR(*pte);
-	if (pg == PTE_ZERO || mem_phys2pi(pg)->refcount > 1) {
-		pageinfo *npi = mem_alloc(); assert(npi);
-		mem_incref(npi);
-		intptr_t npg = mem_pi2phys(npi);
-		memmove((void*)npg, (void*)pg, PAGESIZE); // copy the page
-		if (pg != PTE_ZERO)
-			mem_decref(mem_phys2pi(pg), mem_free); // drop old ref
-		pg = npg;
-	}
-	*pte = pg | SYS_RW | PTE_A | PTE_D | PTE_W | PTE_U | PTE_P;
+#if LAB >= 9
+	// Writes marching sequentially through a copy-on-write region
+	// double the window of following pages we copy ahead of time;
+	// any other write fault shrinks it back to nothing.
+	uintptr_t va = PGADDR(fva);
+	if (va == p->pfnext)
+		p->pfwin = p->pfwin ? MIN(p->pfwin * 2, PMAP_FAULTAROUND) : 1;
+	else
+		p->pfwin = 0;
+	int i;
+	for (i = 0; i < p->pfwin; i++, size += PAGESIZE)
+		if (!pmap_prewrite_page(p->pml4, va + size))
+			break;
+	p->pfnext = va + size;
+#endif
 
-	// Make sure the old mapping doesn't get used anymore
-	pmap_inval(p->pml4, PGADDR(fva), PAGESIZE);
+	// Make sure the old mappings don't get used anymore
+	pmap_inval(p->pml4, PGADDR(fva), size);
 
 	trap_return(tf);
 #else /* not SOL >= 3 */
@@ -817,7 +1000,7 @@ pmap_merge_level(int pmlevel, pte_t *rpmtab, pte_t *spmtab, intptr_t sva,
 			// unchanged in source, do nothing
 		} else if (*dpmte == *rpmte) {
 			// unchanged in dest, copy from source
-			pmap_copy_level(pmlevel, spmtab, sva, dpmtab, dva, sva + PDSIZE(pmlevel));
+			pmap_copy_level(pmlevel, spmtab, sva, dpmtab, NULL, dva, sva + PDSIZE(pmlevel));
 		} else {
 			if (pmlevel > 0) {
 				// jump into lower level
@@ -53,10 +53,19 @@ void pmap_remove(pte_t *pml4, intptr_t uva, size_t size);
 void pmap_inval(pte_t *pml4, intptr_t uva, size_t size);
 int pmap_copy(pte_t *spml4, intptr_t sva, pte_t *dpml4, intptr_t dva,
 		size_t size);
+int pmap_copysnap(pte_t *spml4, intptr_t sva, pte_t *dpml4, pte_t *rpml4,
+		intptr_t dva, size_t size);
+bool pmap_same(pte_t *apml4, pte_t *bpml4, intptr_t va, size_t size);
 int pmap_merge(pte_t *rpml4, pte_t *spdir, intptr_t sva,
 		pte_t *dpml4, intptr_t dva, size_t size);
 int pmap_setperm(pte_t *pml4, intptr_t va, size_t size, int perm);
 void pmap_pagefault(trapframe *tf);
+#if LAB >= 9
+void pmap_prewrite(pte_t *pml4, intptr_t va, size_t size);
+
+// Maximum number of pages pmap_pagefault copies ahead of a sequential writer
+#define PMAP_FAULTAROUND	16
+#endif
 void pmap_check(void);
 void pmap_check_adv(void);
 void pmap_print(pte_t *pml4);
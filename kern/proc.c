@@ -25,6 +25,8 @@
 
 #if LAB >= 9
 #include <dev/pmc.h>
+#include <dev/e100.h>
+#include <dev/virtio.h>
 #endif
 
 
@@ -39,6 +41,9 @@ static spinlock midlock;
 static spinlock readylock;	// Spinlock protecting ready queue
 static proc *readyhead;		// Head of ready queue
 static proc **readytail;	// Tail of ready queue
+#if LAB >= 9
+static proc **readygang;	// Just past the gangs at head of ready queue
+#endif
 static spinlock pacinglock;	// spinlock for pacing queue
 static proc *pacinghead;	// head of pacing queue
 static proc **pacingtail;	// tail of pacing queue
@@ -46,6 +51,11 @@ static proc **pacingtail;	// tail of pacing queue
 // LAB 2: insert your scheduling data structure declarations here.
 #endif
 
+#if LAB >= 9
+static void proc_round(proc *p);
+static void proc_runnow(proc *p);
+#endif
+
 
 void
 proc_init(void)
@@ -57,6 +67,9 @@ proc_init(void)
 	spinlock_init(&readylock);
 	readytail = &readyhead;
 	readyhead = NULL;
+#if LAB >= 9
+	readygang = &readyhead;
+#endif
 	spinlock_init(&pacinglock);
 	pacingtail = &pacinghead;
 	pacinghead = NULL;
@@ -145,6 +158,29 @@ proc_ready(proc *p)
 	panic("proc_ready not implemented");
 #endif	// SOL >= 2
 }
+#if LAB >= 9
+
+// Make p ready as a member of a gang its parent is starting.
+// Gang members go ahead of ordinary ready processes,
+// each just behind the ones queued before it,
+// so that CPUs pick up a gang's members together
+// rather than one at a time between unrelated work.
+void
+proc_readygang(proc *p)
+{
+	spinlock_acquire(&readylock);
+
+	p->state = PROC_READY;
+	p->waitproc = NULL;
+	p->readynext = *readygang;
+	*readygang = p;
+	if (readytail == readygang)
+		readytail = &p->readynext;
+	readygang = &p->readynext;
+
+	spinlock_release(&readylock);
+}
+#endif	// LAB >= 9
 
 // Save the current process's state before switching to another process.
 // Copies trapframe 'tf' into the proc struct,
@@ -202,18 +238,28 @@ proc_save(proc *p, trapframe *tf, int entry)
 void gcc_noreturn
 proc_wait(proc *p, proc *cp, trapframe *tf, uint64_t ts)
 {
-	cprintf("[proc wait] p %p(%x) cp %p(%x) ts %llx\n", p, p->state, cp, cp->state, ts);
+	cprintf("[proc wait] p %p(%x) cp %p(%x) ts %llx\n", p, p->state, cp, cp ? cp->state : 0, ts);
 #if SOL >= 2
 	assert(spinlock_holding(&p->lock));
+#if LAB >= 9
+	if (cp == NULL)		// waiting for any of a set of children
+		assert(ts == 0 && (p->grpwait || p->anywait));
+	else
+#endif
+	{
 	assert(cp && cp != &proc_null);	// null proc is always stopped
 	assert(ts != 0 || cp->state != PROC_STOP);
 	assert(ts != 0 || cp->state != PROC_BLOCK || cp->waitproc != p);
+	}
 
 	p->state = PROC_WAIT;
 	p->runcpu = NULL;
 	p->waitproc = cp;	// remember what child we're waiting on
 	p->ts = ts;
 	proc_save(p, tf, 0);	// save process state before INT instruction
+#if LAB >= 9
+	proc_round(p);		// our group's round may have been waiting on us
+#endif
 
 	spinlock_release(&p->lock);
 
@@ -227,6 +273,13 @@ proc_wait(proc *p, proc *cp, trapframe *tf, uint64_t ts)
 //		cprintf("[proc wait] pacinghead %p pacingtail %p -> %p\n", pacinghead, pacingtail, *pacingtail);
 		spinlock_release(&pacinglock);
 	}
+#if LAB >= 9
+
+	// If we just started the child we're waiting for,
+	// run it here instead of leaving our CPU to whatever is next.
+	if (cp != NULL && cp != proc_net && ts == 0)
+		proc_runnow(cp);
+#endif
 
 	proc_sched();
 #else	// SOL >= 2
@@ -248,11 +301,25 @@ proc_wake(proc *p, uint64_t time)
 		// child is stopped
 		p->waitproc = NULL;
 	}
+#if LAB >= 9
+	if (p->grpwait && proc_grpnext(p) != -1) {
+		// a group member has stopped for us
+		p->grpwait = false;
+	}
+	if (p->anywait && proc_anynext(p) != -1) {
+		// one of the children we're waiting on has stopped
+		p->anywait = false;
+	}
+#endif
 	if (time > p->ts) {
 		// timestamp has passed
 		p->ts = 0;
 	}
 	if (p->waitproc == NULL && p->ts == 0) {
+#if LAB >= 9
+		if (p->grpwait || p->anywait)
+			return;
+#endif
 		proc_ready(p);
 	}
 }
@@ -290,6 +357,155 @@ proc_wake_all(uint64_t time)
 	spinlock_release(&pacinglock);
 }
 
+#if LAB >= 9
+
+// Copy [va,va+size) from p into child cp at the same address,
+// and give cp a reference snapshot of just that range.
+// If p's memory in that range hasn't changed since the snapshot
+// it last handed out for the same range, the child shares that snapshot;
+// otherwise a new one is built in the same walk as the copy.
+void
+proc_sibsnap(proc *p, proc *cp, intptr_t va, size_t size)
+{
+	pte_t *snap = p->spml4;
+	if (snap && p->spmva == va && p->spmsize == size
+			&& pmap_same(p->pml4, snap, va, size))
+		pmap_copy(p->pml4, va, cp->pml4, va, size);
+	else {
+		if (snap)
+			mem_decref(mem_ptr2pi(snap), pmap_freepmap);
+		snap = p->spml4 = pmap_newpmap();
+		p->spmva = va;
+		p->spmsize = size;
+		pmap_copysnap(p->pml4, va, cp->pml4, snap, va, size);
+	}
+
+	if (cp->rpml4 != snap) {
+		mem_incref(mem_ptr2pi(snap));
+		mem_decref(mem_ptr2pi(cp->rpml4), pmap_freepmap);
+		cp->rpml4 = snap;
+	}
+}
+
+// Find the member of p's round group that p should get from next.
+// p visits members in a fixed cycle of child numbers starting at grpcur,
+// waiting on each that is still running until it either stops
+// or ends its quantum, so which member p gets next depends only on
+// where members stopped in their instruction streams,
+// never on which of them happened to stop first.
+// Returns its child number, -1 if p must wait for one,
+// or -2 if no member is still running that ever could stop for p.
+int
+proc_grpnext(proc *p)
+{
+	assert(spinlock_holding(&p->lock));
+	int i;
+	bool live = false;
+	for (i = 0; i < PROC_CHILDREN; i++) {
+		int cn = (p->grpcur + i) % PROC_CHILDREN;
+		proc *cp = p->child[cn];
+		if (cp == NULL || cp->grp == GRP_NONE)
+			continue;
+		if (cp->state == PROC_STOP) {
+			if (cp->grpnew)
+				return cn;
+		} else if (cp->state == PROC_ROUND)
+			live = true;	// the round's end will hand it back
+		else
+			return -1;	// must see where this one stops first
+	}
+	return live ? -1 : -2;
+}
+
+// Find the lowest-numbered child in p->anyset that has stopped.
+// Returns its child number, -1 if p must wait for one,
+// or -2 if none of the children in the set exists.
+int
+proc_anynext(proc *p)
+{
+	assert(spinlock_holding(&p->lock));
+	int cn;
+	bool live = false;
+	for (cn = 0; cn < PROC_CHILDREN; cn++) {
+		proc *cp = p->child[cn];
+		if (cp == NULL || !(p->anyset[cn / 8] & (1 << (cn % 8))))
+			continue;
+		if (cp->state == PROC_STOP)
+			return cn;
+		live = true;
+	}
+	return live ? -1 : -2;
+}
+
+// End the current round of p's group once every member has either
+// used up its quantum (PROC_ROUND) or stopped, and p is waiting on
+// the group or one of its members, so that nothing can touch p's memory
+// while the kernel merges into it.
+// If no member stopped for p during the round and p left all of them
+// to the kernel, merge each one's changes into p in child number order,
+// hand each a fresh copy of the result, and start the next round.
+// Each such member used up its whole quantum computing, so, as the master
+// would, double its next one, up to PROC_ROUNDGROW times what it was given.
+// Otherwise hand the round back to p: each member just stops,
+// and p ends the round itself with SYS_GET|SYS_GROUP and SYS_MERGE.
+// Either way the outcome depends only on where in their instruction
+// streams members stopped, never on which of them got there first.
+static void
+proc_round(proc *p)
+{
+	assert(spinlock_holding(&p->lock));
+	if (p->state != PROC_WAIT)
+		return;
+	if (!p->grpwait && (p->waitproc == NULL
+			|| p->waitproc->grp == GRP_NONE))
+		return;		// waking p must not race with our rounds
+
+	int cn, n = 0;
+	bool hand = p->grpdirty;
+	for (cn = 0; cn < PROC_CHILDREN; cn++) {
+		proc *cp = p->child[cn];
+		if (cp == NULL || cp->grp == GRP_NONE)
+			continue;
+		if (cp->state == PROC_ROUND) {
+			n++;
+			if (cp->grp != GRP_AUTO)
+				hand = true;
+		} else if (cp->state != PROC_STOP)
+			return;		// still in the middle of its quantum
+	}
+	if (n == 0)
+		return;
+	p->grpdirty = false;
+
+	for (cn = 0; cn < PROC_CHILDREN; cn++) {
+		proc *cp = p->child[cn];
+		if (cp == NULL || cp->grp == GRP_NONE
+				|| cp->state != PROC_ROUND)
+			continue;
+		if (hand) {
+			cp->state = PROC_STOP;
+			cp->grpnew = true;
+		} else
+			pmap_merge(cp->rpml4, cp->pml4, cp->grpva,
+					p->pml4, cp->grpva, cp->grpsize);
+	}
+	if (hand) {
+		proc_wake(p, 0);
+		return;
+	}
+
+	for (cn = 0; cn < PROC_CHILDREN; cn++) {
+		proc *cp = p->child[cn];
+		if (cp == NULL || cp->grp == GRP_NONE
+				|| cp->state != PROC_ROUND)
+			continue;
+		proc_sibsnap(p, cp, cp->grpva, cp->grpsize);
+		cp->sv.icnt = 0;
+		cp->sv.imax = MIN((uint64_t) cp->sv.imax * 2, cp->grpimax);
+		proc_ready(cp);
+	}
+}
+#endif	// LAB >= 9
 
 void gcc_noreturn
 proc_sched(void)
@@ -308,6 +524,12 @@ proc_sched(void)
 			sti();		// enable device interrupts briefly
 			pause();	// let CPU know we're in a spin loop
 			cli();		// disable interrupts again
+#if LAB >= 9
+			if (e100_polling)	// idle, so help drain the NIC
+				e100_poll();
+			if (virtio_polling)
+				virtio_poll();
+#endif
 		}
 		//cprintf("cpu %d found work\n", cpu_cur()->id);
 
@@ -322,6 +544,10 @@ proc_sched(void)
 		assert(readyhead == NULL);	// ready queue going empty
 		readytail = &readyhead;
 	}
+#if LAB >= 9
+	if (readygang == &p->readynext)	// took the last queued gang member
+		readygang = &readyhead;
+#endif
 	p->readynext = NULL;
 
 	spinlock_acquire(&p->lock);
@@ -333,6 +559,37 @@ proc_sched(void)
 	panic("proc_sched not implemented");
 #endif	// SOL >= 2
 }
+#if LAB >= 9
+
+// Take process p off the ready queue and run it on this CPU right away,
+// if it is still waiting there; otherwise just return.
+static void
+proc_runnow(proc *p)
+{
+	if (cpu_disabled(cpu_cur()))
+		return;
+
+	spinlock_acquire(&readylock);
+	proc **pp = &readyhead;
+	while (*pp != NULL && *pp != p)
+		pp = &(*pp)->readynext;
+	if (*pp == NULL) {	// already picked up by another CPU
+		spinlock_release(&readylock);
+		return;
+	}
+	*pp = p->readynext;
+	if (readytail == &p->readynext)
+		readytail = pp;
+	if (readygang == &p->readynext)
+		readygang = pp;
+	p->readynext = NULL;
+
+	spinlock_acquire(&p->lock);
+	spinlock_release(&readylock);
+
+	proc_run(p);
+}
+#endif	// LAB >= 9
 
 // Switch to and run a specified process, which must already be locked.
 void gcc_noreturn
@@ -410,6 +667,24 @@ proc_yield(trapframe *tf)
 #if SOL >= 2
 	proc *p = proc_cur();
 	assert(p->runcpu == cpu_cur());
+#if LAB >= 9
+
+	// Keep a gang member resident while any of its siblings is still
+	// running, so they don't all end up waiting on it at their barrier,
+	// but only for a few quanta, so a gang can't hog CPUs indefinitely.
+	if (p->gang) {
+		proc *pp = p->parent;
+		spinlock_acquire(&pp->lock);
+		bool hold = p->gang && pp->gangrun > 1
+				&& p->ganghold < PROC_GANGHOLD;
+		spinlock_release(&pp->lock);
+		if (hold) {
+			p->ganghold++;
+			trap_return(tf);
+		}
+	}
+	p->ganghold = 0;
+#endif
 	p->runcpu = NULL;	// this process no longer running
 	proc_save(p, tf, -1);	// save this process's state
 	proc_ready(p);		// put it on tail of ready queue
@@ -461,9 +736,43 @@ proc_ret(trapframe *tf, int entry)
 	cp->state = PROC_STOP;		// we're becoming stopped
 	cp->runcpu = NULL;		// no longer running
 	proc_save(cp, tf, entry);	// save process state after INT insn
+#if LAB >= 9
+
+	if (cp->gang) {			// one fewer of our gang running
+		cp->gang = false;
+		p->gangrun--;
+	}
+
+	// A group member that used up its quantum waits out the round;
+	// one that stopped for any other reason needs its parent.
+	if (cp->grp != GRP_NONE) {
+		if (tf->trapno == T_ICNT)
+			cp->state = PROC_ROUND;
+		else {
+			cp->grpnew = true;
+			p->grpdirty = true;
+		}
+		proc_round(p);
+	}
+
+	// If parent is waiting for just us, give it our CPU directly
+	// rather than queueing it behind whatever else is ready.
+	if (p->state == PROC_WAIT && p->ts == 0 && cp->state == PROC_STOP
+			&& (p->waitproc == cp
+				|| (p->anywait && proc_anynext(p) >= 0))
+			&& !cpu_disabled(cpu_cur())) {
+		p->waitproc = NULL;
+		p->anywait = false;
+		proc_run(p);
+	}
+#endif
 
 	// If parent is waiting to sync with us, wake it up.
-	if (p->state == PROC_WAIT && p->waitproc == cp) {
+	if (p->state == PROC_WAIT && (p->waitproc == cp
+#if LAB >= 9
+			|| p->grpwait || p->anywait
+#endif
+			)) {
 		proc_wake(p, 0);
 	}
 
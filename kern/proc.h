@@ -28,6 +28,11 @@
 #else
 #define PROC_CHILDREN	256	// Max # of children a process can have
 #endif
+#if LAB >= 9
+#define PROC_FETCHAHEAD	16	// Max message pages a receiver asks for at once
+#define PROC_GANGHOLD	4	// Max quanta a gang member keeps its CPU for
+#define PROC_ROUNDGROW	8	// Kernel-ended rounds grow quanta up to this x
+#endif
 
 typedef enum proc_state {
 	PROC_STOP	= 0,	// Passively waiting for parent to run it
@@ -42,7 +47,17 @@ typedef enum proc_state {
 	PROC_SEND,
 	PROC_RECV,
 #endif
+#if LAB >= 9
+	PROC_ROUND,		// Ended a quantum, waiting for its round to end
+#endif
 } proc_state;
+#if LAB >= 9
+
+// Membership of a child in its parent's round group (see proc_round())
+#define GRP_NONE	0	// Not a member
+#define GRP_HAND	1	// Member whose quanta end in the parent
+#define GRP_AUTO	2	// Member whose rounds the kernel may end
+#endif
 
 // Thread control block structure.
 // Consumes 1 physical memory page, though we don't use all of it.
@@ -71,6 +86,11 @@ typedef struct proc {
 
 	pte_t		*pml4;		// Working page map level-4
 	pte_t		*rpml4;		// Reference page map level-4
+#if LAB >= 9
+	pte_t		*spml4;		// Snapshot last shared with children
+	intptr_t	spmva;		// Start of range spml4 covers
+	size_t		spmsize;	// Size of range spml4 covers
+#endif
 #if LAB >= 5
 
 	// Network and process migration state.
@@ -86,11 +106,43 @@ typedef struct proc {
 	void		*pullpg;	// Local page we are pulling into
 	uint8_t		pglev;		// Level: 0=page, 1=page table, 2=pdir
 	uint8_t		arrived;	// Bits 0-2: which parts have arrived
+#if LAB >= 9
+	bool		pullfull;	// Don't accept a delta for this pull
+	bool		pullhashed;	// Page's hash didn't match a local page
+
+	// Pre-copy state, while pushing our memory ahead of a migration.
+	struct proc	*pushnext;	// Next on list of pre-copying procs
+	uint8_t		pushdest;	// Node we're pushing to, 0 if none
+	uint8_t		pushpass;	// Passes over our address space so far
+	int		pushed;		// Pages pushed in the current pass
+	intptr_t	pushva;		// Where the current pass has got to
+	uint8_t		pushedto;	// Node a whole pass went to, 0 if none
+#endif
 #endif
 #endif	// LAB >= 3
 #if LAB >= 9
 
 	int32_t		pmcmax;		// Max insn count set using perf ctrs
+	uintptr_t	pfnext;		// Page a sequential writer faults on next
+	int		pfwin;		// Copy-on-write fault-around window
+
+	// Deterministic round group state.
+	uint8_t		grp;		// GRP_* membership in parent's group
+	bool		grpnew;		// Stopped, and parent hasn't gotten us
+	bool		grpwait;	// Waiting for any member of our group
+	int		grpcur;		// Member to get from next, in turn
+	bool		anywait;	// Waiting for any child in anyset
+	uint8_t		anyset[PROC_CHILDREN/8];	// Bitmap for SYS_ANY
+	bool		grpdirty;	// A member stopped for us this round
+	intptr_t	grpva;		// Start of range merged at round ends
+	size_t		grpsize;	// Size of range merged at round ends
+	uint32_t	grpimax;	// Longest quantum kernel-ended rounds give
+
+	// Gang scheduling state.
+	bool		gang;		// Started in a gang, hasn't returned
+	int		ganghold;	// Quanta kept resident for the gang so far
+	int		gangrun;	// Our children started in a gang
+					// that haven't returned yet
 #endif
 	uint64_t mid;
 	label_t		label;
@@ -101,6 +153,11 @@ typedef struct proc {
 	uint64_t	remoteid;
 	intptr_t	remoteva;
 	intptr_t	remotelimit;
+#if LAB >= 9
+	int		fetchwin;	// Pages of the message to keep requested
+	int		fetchsent;	// Pages requested so far, from pullva on
+	uint8_t		fetched[PROC_FETCHAHEAD]; // Parts arrived, by page number
+#endif
 } proc;
 
 #define proc_cur()	(cpu_cur()->proc)
@@ -121,6 +178,9 @@ extern hashtable *midtable;
 void proc_init(void);	// Initialize process management code
 proc *proc_alloc(proc *p, uint32_t cn);	// Allocate new child
 void proc_ready(proc *p);	// Make process p ready
+#if LAB >= 9
+void proc_readygang(proc *p);	// Make p ready along with its gang
+#endif
 void proc_save(proc *p, trapframe *tf, int entry);	// save process state
 void proc_wait(proc *p, proc *cp, trapframe *tf, uint64_t wait_ts) gcc_noreturn;
 void proc_wake(proc *p, uint64_t time);
@@ -130,6 +190,11 @@ void proc_run(proc *p) gcc_noreturn;	// Run a specific process
 void proc_yield(trapframe *tf) gcc_noreturn;	// Yield to another process
 void proc_ret(trapframe *tf, int entry) gcc_noreturn;	// Return to parent
 void proc_block(proc *p, proc *cp, trapframe *tf) gcc_noreturn; // block cp, wait for p
+#if LAB >= 9
+void proc_sibsnap(proc *p, proc *cp, intptr_t va, size_t size);
+int proc_grpnext(proc *p);	// Next group member p should get
+int proc_anynext(proc *p);	// Next child in p->anyset to get
+#endif
 
 int proc_set_label(proc *p, tag_t tag);
 int proc_set_clearance(proc *p, tag_t tag);
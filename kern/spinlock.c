@@ -51,6 +51,23 @@ spinlock_acquire(struct spinlock *lk)
 #endif // SOL >= 2
 }
 
+#if LAB >= 9
+// Acquire the lock if it's free and return true, else return false
+// at once, e.g., where waiting for it could invert the lock order.
+int
+spinlock_try(struct spinlock *lk)
+{
+#if SOL >= 2
+	if (spinlock_holding(lk) || xchg(&lk->locked, 1) != 0)
+		return 0;
+
+	lk->cpu = cpu_cur();
+	debug_trace(read_rbp(), lk->eips);
+	return 1;
+#endif // SOL >= 2
+}
+#endif // LAB >= 9
+
 // Release the lock.
 void
 spinlock_release(struct spinlock *lk)
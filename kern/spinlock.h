@@ -36,6 +36,9 @@ typedef struct spinlock {
 
 void spinlock_init_(spinlock *lk, const char *file, int line);
 void spinlock_acquire(spinlock *lk);
+#if LAB >= 9
+int spinlock_try(spinlock *lk);
+#endif
 void spinlock_release(spinlock *lk);
 int spinlock_holding(spinlock *lk);
 void spinlock_check();
@@ -90,7 +90,7 @@ sysrecover(trapframe *ktf, void *recoverdata)
 // Note: Be careful that your arithmetic works correctly
 // even if size is very large, e.g., if uva+size wraps around!
 //
-static void checkva(trapframe *utf, uint32_t uva, size_t size)
+static void checkva(trapframe *utf, uintptr_t uva, size_t size)
 {
 #if SOL >= 3
 	if (uva < VM_USERLO || uva >= VM_USERHI
@@ -148,6 +148,34 @@ do_cputs(trapframe *tf, uint32_t cmd)
 	trap_return(tf);	// syscall completed
 }
 #if SOL >= 2
+#if SOL >= 3
+
+// Make sure child cp has a reference snapshot of its own to write into,
+// not one it shares with its siblings via SYS_SIBSNAP.
+static void
+do_snapown(proc *cp)
+{
+#if LAB >= 9
+	if (mem_ptr2pi(cp->rpml4)->refcount > 1) {
+		mem_decref(mem_ptr2pi(cp->rpml4), pmap_freepmap);
+		cp->rpml4 = pmap_newpmap();
+	}
+#endif
+}
+#if LAB >= 9
+
+// Copy [sva,sva+size) from p into child cp at the same address,
+// and give cp a reference snapshot of just that range.
+static void
+do_sibsnap(trapframe *tf, proc *p, proc *cp,
+		uintptr_t sva, uintptr_t dva, size_t size)
+{
+	if (sva != dva || size == 0)
+		systrap(tf, T_GPFLT, 0);
+	proc_sibsnap(p, cp, sva, size);
+}
+#endif	// LAB >= 9
+#endif	// SOL >= 3
 
 static void
 do_put(trapframe *tf, uint32_t cmd)
@@ -155,6 +183,14 @@ do_put(trapframe *tf, uint32_t cmd)
 	proc *p = proc_cur();
 	assert(p->state == PROC_RUN && p->runcpu == cpu_cur());
 //	cprintf("PUT proc %p rip %p rsp %p cmd %x\n", p, tf->rip, tf->rsp, cmd);
+#if LAB >= 9
+
+	// The kernel ends a round by merging back and recopying one range.
+	if ((cmd & SYS_ROUND) && (!(cmd & SYS_GROUP)
+			|| (cmd & SYS_MEMOP) != SYS_COPY
+			|| tf->rsi != tf->rdi || tf->rcx == 0))
+		systrap(tf, T_GPFLT, 0);
+#endif
 
 	if (cmd & SYS_REMOTE == 0) {
 #if SOL >= 5
@@ -314,7 +350,30 @@ do_put(trapframe *tf, uint32_t cmd)
 			pmap_remove(cp->pml4, dva, size);
 			break;
 		case SYS_COPY:	// copy from local src to dest in child
-			pmap_copy(p->pml4, sva, cp->pml4, dva, size);
+#if LAB >= 9
+			if (cmd & SYS_SIBSNAP) {
+				do_sibsnap(tf, p, cp, sva, dva, size);
+				cmd &= ~(SYS_SNAP | SYS_SIBSNAP);
+				break;
+			}
+#endif
+			if ((cmd & (SYS_SNAP | SYS_PERM)) == SYS_SNAP) {
+				// copy and snapshot the copied range in one walk,
+				// then snapshot the rest of the child below.
+				do_snapown(cp);
+				pmap_copysnap(p->pml4, sva, cp->pml4,
+						cp->rpml4, dva, size);
+				if (dva > VM_USERLO)
+					pmap_copy(cp->pml4, VM_USERLO,
+						cp->rpml4, VM_USERLO,
+						dva - VM_USERLO);
+				if (dva + size < VM_USERHI)
+					pmap_copy(cp->pml4, dva + size,
+						cp->rpml4, dva + size,
+						VM_USERHI - (dva + size));
+				cmd &= ~SYS_SNAP;
+			} else
+				pmap_copy(p->pml4, sva, cp->pml4, dva, size);
 			break;
 		}
 		break;
@@ -332,15 +391,47 @@ do_put(trapframe *tf, uint32_t cmd)
 			panic("pmap_put: no memory to set permissions");
 	}
 
-	if (cmd & SYS_SNAP)	// Snapshot child's state
+#if LAB >= 9
+	if (cmd & SYS_SIBSNAP)	// only meaningful along with SYS_COPY
+		systrap(tf, T_GPFLT, 0);
+#endif
+	if (cmd & SYS_SNAP) {	// Snapshot child's state
+		do_snapown(cp);
 		pmap_copy(cp->pml4, VM_USERLO, cp->rpml4, VM_USERLO,
 				VM_USERHI-VM_USERLO);
+	}
+#if LAB >= 9
+
+	// Place the child in our round group, or take it out of it.
+	if (!(cmd & SYS_REMOTE)) {
+		cp->grp = !(cmd & SYS_GROUP) ? GRP_NONE :
+			(cmd & SYS_ROUND) ? GRP_AUTO : GRP_HAND;
+		cp->grpnew = false;
+		cp->grpimax = MIN((uint64_t) cp->sv.imax * PROC_ROUNDGROW,
+					(uint32_t) ~0);
+		if ((cmd & SYS_GROUP) && (cmd & SYS_MEMOP) == SYS_COPY) {
+			cp->grpva = dva;
+			cp->grpsize = size;
+		}
+	}
+#endif
 
 #endif	// SOL >= 3
 
 exit:
 //	cprintf("PUT cmd %x\n", cmd);
 	// Start the child if requested
+#if LAB >= 9
+	if ((cmd & (SYS_START | SYS_GANG | SYS_REMOTE))
+			== (SYS_START | SYS_GANG)) {
+		spinlock_acquire(&p->lock);
+		p->gangrun++;
+		cp->gang = true;
+		cp->ganghold = 0;
+		spinlock_release(&p->lock);
+		proc_readygang(cp);
+	} else
+#endif
 	if (cmd & SYS_START)
 		proc_ready(cp);
 
@@ -357,15 +448,65 @@ do_get(trapframe *tf, uint32_t cmd)
 #if SOL >= 5
 	// First migrate if we need to.
 	uint8_t node = (tf->rdx >> 8) & 0xff;
+#if LAB >= 9
+	if (cmd & SYS_ANY)
+		node = 0;	// EDX holds the set; our children are at home
+#endif
 	if (node == 0) node = RRNODE(p->home);		// Goin' home
+#if LAB >= 9
+	if (cmd & SYS_PRECOPY) {
+		if (node != net_node)
+			net_precopy(p, node);	// push memory, but stay here
+		trap_return(tf);
+	}
+#endif
 	if (node != net_node)
 		net_migrate(tf, node, 0);	// abort syscall and migrate
 
 #endif // SOL >= 5
+#if LAB >= 9
+	if (cmd & SYS_ANY) {
+		// Which child we'd get depends on timing.
+		if (!(p->sv.pff & PFF_NONDET) || (cmd & SYS_GROUP))
+			systrap(tf, T_GPFLT, 0);
+		usercopy(tf, 0, p->anyset, tf->rdx, sizeof(p->anyset));
+	}
+#endif
 	spinlock_acquire(&p->lock);
 
 	// Find the named child process; DON'T create if it doesn't exist
 	uint32_t cn = tf->rdx & 0xff;
+#if LAB >= 9
+	if (cmd & SYS_GROUP) {
+		// Take whichever member of our round group stopped for us,
+		// waiting until one does if none has yet.
+		int gn = proc_grpnext(p);
+		if (gn == -1) {
+			p->grpwait = true;
+			proc_wait(p, NULL, tf, 0);
+		}
+		if (gn < 0) {
+			spinlock_release(&p->lock);
+			tf->rax = -1;	// nothing left in the group
+			trap_return(tf);
+		}
+		cn = gn;
+		p->grpcur = (gn + 1) % PROC_CHILDREN;	// visit the rest next
+	} else if (cmd & SYS_ANY) {
+		// Take the first child in the caller's set that has stopped.
+		int an = proc_anynext(p);
+		if (an == -1) {
+			p->anywait = true;
+			proc_wait(p, NULL, tf, 0);
+		}
+		if (an < 0) {
+			spinlock_release(&p->lock);
+			tf->rax = -1;	// no such children at all
+			trap_return(tf);
+		}
+		cn = an;
+	}
+#endif
 	proc *cp = p->child[cn];
 	if (!cp)
 		cp = &proc_null;
@@ -394,6 +535,10 @@ do_get(trapframe *tf, uint32_t cmd)
 		spinlock_release(&p->lock);
 		goto exit;
 	}
+#if LAB >= 9
+	if (cp != &proc_null)
+		cp->grpnew = false;	// we've seen this stop now
+#endif
 
 	// Since the child is now stopped, it's ours to control;
 	// we no longer need our process lock -
@@ -469,12 +614,28 @@ do_get(trapframe *tf, uint32_t cmd)
 		if (!pmap_setperm(p->pml4, dva, size, cmd & SYS_RW))
 			panic("pmap_get: no memory to set permissions");
 	}
+#if LAB >= 9
+
+	if (cmd & SYS_PREFAULT) {
+		// validate destination region
+		if (PGOFF(dva) || PGOFF(size)
+				|| dva < VM_USERLO || dva > VM_USERHI
+				|| size > VM_USERHI-dva)
+			systrap(tf, T_GPFLT, 0);
+		if (size > 0)
+			pmap_prewrite(p->pml4, dva, size);
+	}
+#endif
 
 	if (cmd & SYS_SNAP)
 		systrap(tf, T_GPFLT, 0);	// only valid for PUT
 
 #endif	// SOL >= 3
 exit:
+#if LAB >= 9
+	if (cmd & (SYS_GROUP | SYS_ANY))
+		tf->rax = cn;	// tell caller which child it got
+#endif
 	trap_return(tf);	// syscall completed
 }
 
@@ -43,6 +43,9 @@
 #if LAB >= 5
 #include <dev/e100.h>
 #endif
+#if LAB >= 9
+#include <dev/virtio.h>
+#endif
 #endif // LAB >= 2
 
 
@@ -363,9 +366,7 @@ trap(trapframe *tf)
 		assert(p->sv.pff & PFF_ICNT);
 		assert(pmc_get != NULL);
 		int32_t ninsn = pmc_get(p->pmcmax);
-		int32_t overshoot = ninsn - p->pmcmax;
-		if (overshoot > pmc_overshoot)
-			pmc_overshoot = overshoot;
+		pmc_skid(ninsn - p->pmcmax);
 		//cprintf("T_PERFCTR: after %d tgt %d ovr %d max %d\n",
 		//	ninsn, p->pmcmax, overshoot, pmc_overshoot);
 		p->sv.icnt += ninsn;
@@ -391,6 +392,13 @@ trap(trapframe *tf)
 		lapic_eoi();
 		trap_return(tf);
 	}
+#if LAB >= 9
+	if (virtio_present && tf->trapno == T_IRQ0 + virtio_irq) {
+		virtio_intr();
+		lapic_eoi();
+		trap_return(tf);
+	}
+#endif
 #endif // ! SOL >= 5
 	if (tf->cs & 3) {		// Unhandled trap from user mode
 		cprintf("trap in proc %x, reflecting to proc %x\n",
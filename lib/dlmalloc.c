@@ -15,52 +15,126 @@
 #include <inc/string.h>
 #include <inc/assert.h>
 
+// Each forked child allocates from its own page-aligned arena,
+// HEAP_SZ bytes starting at HEAP_LO + HEAP_SZ * thread number,
+// so its chunk headers, bins and data never share a byte with another
+// child's and the parent's byte-level merge never sees a conflict.
+// Arenas survive the join: objects a child returns stay valid,
+// and the next child forked with the same number keeps allocating there.
+// This covers one level of fork-join; grandchildren reuse the numbers.
 #define TID ((int)files->thself)
+#define THOWNER(p) (((uintptr_t)(p) - HEAP_LO) / HEAP_SZ)
+#define THARENA(p) ((uintptr_t)(p) >= HEAP_LO && (uintptr_t)(p) < HEAP_HI)
 
 static mspace child_mspace[MAXTHREADS];
-static inline void *
-mspace_alloc_pages()
+static char *child_brk[MAXTHREADS];	// end of each arena's mapped part
+
+// Map size more bytes at the end of thread t's arena.
+static void *
+tharena_grow(int t, size_t size)
+{
+	char *base = (char*)(HEAP_LO + HEAP_SZ * t);
+	char *m = child_brk[t] ? child_brk[t] : base;
+	size = ROUNDUP(size, PAGESIZE);
+	if (size > base + HEAP_SZ - m)
+		return (void*)~(uintptr_t)0;	// MFAIL
+	sys_get(SYS_PERM | SYS_RW, 0, NULL, NULL, m, size);
+	child_brk[t] = m + size;
+	return m;
+}
+
+// dlmalloc grows an mspace through MMAP and DIRECT_MMAP.
+// Keep that memory inside the calling thread's arena once it has one,
+// rather than taking it from the program-wide sbrk every child shares.
+static void *
+thmmap(size_t size)
+{
+	if (child_mspace[TID] == 0)
+		return mmap(0, size, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	return tharena_grow(TID, size);
+}
+
+// dlmalloc hands back what it got from MMAP through MUNMAP.
+// An arena only grows, so its addresses aren't reused,
+// but the pages behind them go back to the system.
+static int
+thmunmap(void *addr, size_t size)
+{
+	if (!THARENA(addr))
+		return munmap(addr, size);
+	assert(PGOFF(addr) == 0);
+	sys_get(SYS_ZERO, 0, NULL, NULL, addr, ROUNDUP(size, PAGESIZE));
+	return 0;
+}
+#define MMAP(s)		thmmap(s)
+#define DIRECT_MMAP(s)	thmmap(s)
+#define MUNMAP(a, s)	thmunmap(a, s)
+
+// Reserve thread t's arena, typically in the parent just before forking t,
+// so the child starts with its allocator state already in place.
+void
+thfork(int t)
 {
-	void *mem = (void*)(HEAP_LO + HEAP_SZ * TID);
-	sys_get(SYS_ZERO | SYS_PERM | SYS_RW, 0, NULL, NULL, mem, HEAP_SZ);
-	return mem;
+	assert(t >= 0 && t < MAXTHREADS);
+	if (child_mspace[t] != 0)
+		return;		// keep the arena a previous child left behind
+	void *base = tharena_grow(t, THHEAP_INIT);
+	child_mspace[t] = create_mspace_with_base(base, THHEAP_INIT, 0);
+	if (child_mspace[t] == 0)
+		panic("thfork: per thread memory space too small");
 }
-	
+
 void *
 thmalloc(size_t bytes)
 {
-	cprintf("allocating %d bytes for thread %d...\n", bytes, TID);
-	if(child_mspace[TID] == 0) {
-		child_mspace[TID] = create_mspace_with_base(mspace_alloc_pages(),HEAP_SZ, 0);
-		if(child_mspace[TID] == 0) {
-			cprintf("per thread memory space too small!\n");
-			return 0;
-		}
-	}
-
+	if (child_mspace[TID] == 0)
+		thfork(TID);
 	return mspace_malloc(child_mspace[TID], bytes);
 }
 
+// Only the owner, or the master once it has joined the owner,
+// may free a chunk: freeing another running child's chunk would write
+// that child's allocator metadata and conflict when both are merged.
+// A child freeing a sibling's chunk therefore just leaves it allocated.
 void
 thfree(void *mem)
 {
-	assert(child_mspace[TID] != 0);
-	mspace_free(child_mspace[TID], mem);
+	if (mem == 0)
+		return;
+	assert(THARENA(mem));
+	int t = THOWNER(mem);
+	if (t == TID || TID == 0)
+		mspace_free(child_mspace[t], mem);
 }
 
 void *
 thcalloc(size_t num, size_t bytes)
 {
 	void *ret = thmalloc(num * bytes);
-	memset(ret, 0, num*bytes);
+	if (ret != 0)
+		memset(ret, 0, num*bytes);
 	return ret;
 }
 
+// Reallocating a sibling's chunk copies it into our own arena.
 void *
 threalloc(void *mem, size_t bytes)
 {
-	assert(child_mspace[TID] != 0);
-	return mspace_realloc(child_mspace[TID], mem, bytes);
+	if (mem == 0)
+		return thmalloc(bytes);
+	assert(THARENA(mem));
+	int t = THOWNER(mem);
+	if (t == TID)
+		return mspace_realloc(child_mspace[t], mem, bytes);
+
+	void *ret = thmalloc(bytes);
+	if (ret != 0) {
+		size_t n = mspace_usable_size(mem);
+		memcpy(ret, mem, MIN(n, bytes));
+		thfree(mem);
+	}
+	return ret;
 }
 
 /*------------------------------ internal #includes ---------------------- */
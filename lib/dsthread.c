@@ -21,12 +21,16 @@
 // Tunable scheduling policy parameters (could be made variables).
 //#define P_QUANTUM	0	// Number of instructions per thread quantum
 #define P_QUANTUM	10000000	// Number of instructions per thread quantum
+#define P_QUANTUMMIN	(P_QUANTUM/64)	// Shortest quantum for syncing threads
+#define P_QUANTUMMAX	(P_QUANTUM*8)	// Longest quantum for compute threads
 #define P_MUTEXFAIR	0	// Mutex transfer in strict round-robin order
 #define P_MUTEXIMMED	0	// Pass on mutex immediately on unlock
 
 
-#define MAXTHREADS	16		// must be power of two
-//#define MAXTHREADS	256		// must be power of two
+// Each thread is a child process of the master, named by its thread number,
+// so the kernel's 8-bit child numbers bound how many threads we can have.
+// Stacks and heaps are carved out per slot, but only touched once used.
+#define MAXTHREADS	256		// must be power of two
 #define MAXKEYS		1000
 
 // Thread states
@@ -42,9 +46,12 @@ typedef struct pthread {
 	int		state;		// thread's current state
 	int		detached;	// true if thread can never join
 	struct pthread *qnext;		// next on scheduler or wait queue
+	struct pthread **qprev;		// link to us while on the run queue
 	pthread_mutex_t*reqs;		// mutexes req'd by other threads
 	struct pthread *joiner;		// thread blocked joining this thread
 	void *		exitval;	// value thread returned on exit
+	struct pthread *freenext;	// next on list of reusable slots
+	uint32_t	quantum;	// insns per quantum, adapted by tadapt()
 
 	// state save area for blocked (but not preempted) threads
 	uint32_t	pff;		// process feature flags
@@ -94,7 +101,8 @@ typedef struct threadpriv {
 
 
 static pthread th[MAXTHREADS];
-static int tmax;	// first unused thread
+static int tmax;	// first never-used thread
+static pthread *tfree;	// slots below tmax that are free for reuse
 
 // This word serves as the main low-level "lock" for the thread system:
 //	-1 = thread library not yet initialized
@@ -104,7 +112,15 @@ static int tmax;	// first unused thread
 // When the master process preempts a child and discovers tlock == 1,
 // it just sets tlock = 2 and resumes execution of the thread (as the master),
 // giving the pthread code running on behalf of the thread a chance to finish.
-static volatile int tlock = -1;
+// Each thread has its own word, and the scheduler stack one more,
+// so the kernel can merge a whole round of threads without conflicts.
+static volatile int tlocks[MAXTHREADS+1] = { -1 };
+#define tlock	(*tlockp())
+
+// Number of threads blocked waiting on some other thread.
+// While there are any, the master must see every quantum end,
+// since that is when it passes mutexes and wakeups on.
+static int nwaiting;
 
 // Round-robin scheduler queues.
 // The ready queue contains threads that are definitely waiting to be run;
@@ -142,7 +158,7 @@ static void condwakeups(void);
 static gcc_inline int
 selfno(void)
 {
-	int tno = (uint32_t)(VM_STACKHI - read_rsp()) / TSTACKSIZE;
+	int tno = (uintptr_t)(VM_STACKHI - read_rsp()) / TSTACKSIZE;
 	assert(tno >= 0 && tno < MAXTHREADS);
 	return tno;
 }
@@ -153,6 +169,23 @@ self(void)
 	return &th[selfno()];
 }
 
+static gcc_inline volatile int *
+tlockp(void)
+{
+	if (read_rsp() >= VM_STACKHI)
+		return &tlocks[MAXTHREADS];	// on the scheduler stack
+	return &tlocks[selfno()];
+}
+
+// Round group flags to (re)start a thread with.
+// When no thread is waiting on another, the kernel can end the threads'
+// quanta itself, and we only hear from threads that call into the master.
+static gcc_inline uint32_t
+tgroup(void)
+{
+	return SYS_GROUP | (nwaiting == 0 ? SYS_ROUND : 0);
+}
+
 // Child process code for the MCALLPAGE.
 asm("cmcalls: int $48; ret; cmcalle:");
 extern char cmcalls[], cmcalle[];
@@ -170,6 +203,7 @@ init(void)
 
 	assert(tlock < 0);
 	tlock = 2;		// we start out as the master process
+	tlocks[MAXTHREADS] = 2;	// and so does the scheduler
 
 	// Create the scheduler stack.
 	sys_get(SYS_PERM | SYS_RW, 0, NULL, NULL,
@@ -200,7 +234,7 @@ static void
 tdump(void)
 {
 	int i;
-	for (i = 0; i < MAXTHREADS; i++) {
+	for (i = 0; i < tmax; i++) {
 		if (th[i].state == TH_FREE)
 			continue;
 		cprintf("thread %d: state %d eip %x esp %x\n",
@@ -220,6 +254,22 @@ tevents(pthread_t t)
 		mutexreqs(t);
 }
 
+// Adapt a thread's quantum to how it used its last one.
+// A thread that ran out its quantum without synchronizing is computing,
+// so give it longer to amortize the merge at the end of each quantum;
+// a thread that called into the master early is synchronizing often,
+// so shorten its quantum to keep other threads from waiting on it.
+// This depends only on where in the instruction stream threads
+// synchronize, never on timing, so the schedule stays deterministic.
+static gcc_inline void
+tadapt(pthread_t t, bool expired)
+{
+	if (expired)
+		t->quantum = MIN(t->quantum * 2, P_QUANTUMMAX);
+	else
+		t->quantum = MAX(t->quantum / 2, P_QUANTUMMIN);
+}
+
 // Place a thread we're about to run on the run queue.
 // This can be called on either the scheduler's or a thread's stack,
 // though always in the context of the master thread.
@@ -233,6 +283,7 @@ trun(pthread_t t)
 	// so the scheduler will collect its results sometime later.
 	assert(t->qnext == NULL); assert(*runqtail == NULL);
 	*runqtail = t;
+	t->qprev = runqtail;
 	runqtail = &t->qnext;
 	assert(++runqlen <= MAXTHREADS);
 }
@@ -268,7 +319,8 @@ pthread_sched(void)
 		// (asm fragment does not return here)
 	}
 
-	// Now collect results from threads in the run queue.
+	// Now collect results from threads in the run queue,
+	// in the fixed order in which the kernel hands them back to us.
 	// Use a static procstate struct so we can refer to it below
 	// without referring to any registers we're trying to restore.
 	static procstate ps;
@@ -286,20 +338,38 @@ if (++dispcnt >= 1000000000/P_QUANTUM) {
 			tdump();
 			panic("sched: no running threads - deadlock?");
 		}
-		t = runqhead;
-		if ((runqhead = t->qnext) == NULL)	// dequeue first thread
-			runqtail = &runqhead;		// for good measure
-		t->qnext = NULL;
-		assert(--runqlen >= 0);
 
-		// Merge the thread's memory changes and get its register state.
-		tlock = 0;	// default state for user procs
-		sys_get(SYS_REGS | SYS_MERGE, t->tno, &ps,
+		// Merge the memory changes of the next thread that stopped
+		// for us, and get its register state.
+		int tno = sys_getgroup(SYS_REGS | SYS_MERGE, &ps,
 			(void*)VM_USERLO, (void*)VM_USERLO,
 			VM_PRIVLO - VM_USERLO);
-		int olock = tlock;
-		tlock = 2;
+		if (tno < 0) {
+			tdump();
+			panic("sched: no running threads - deadlock?");
+		}
+		t = &th[tno];
+		assert(t->qprev != NULL && *t->qprev == t);
+		if ((*t->qprev = t->qnext) != NULL)	// dequeue the thread
+			t->qnext->qprev = t->qprev;
+		else
+			runqtail = t->qprev;
+		t->qnext = NULL;
+		t->qprev = NULL;
+		assert(--runqlen >= 0);
+
+		int olock = tlocks[tno];
+		if (olock == 1)
+			tlocks[tno] = 2;	// it resumes in the master
 
+#if P_QUANTUM > 0
+		// Pick up where rounds the kernel ended have grown its quantum.
+		t->quantum = MIN(MAX(ps.imax, P_QUANTUMMIN), P_QUANTUMMAX);
+		if (ps.tf.trapno == T_ICNT)
+			tadapt(t, 1);	// used its whole quantum
+		else if (olock == 1)
+			tadapt(t, 0);	// called the master via mcall()
+#endif
 		if (olock == 1)	// Was the thread running pthread code?
 			break;	// if so, resume thread in master below.
 		assert(olock == 0);
@@ -319,12 +389,10 @@ if (++dispcnt >= 1000000000/P_QUANTUM) {
 		// Resume the thread's execution, with new memory state,
 		// and the same register state except for a new quantum.
 		ps.icnt = 0;
-		ps.imax = P_QUANTUM;
-		tlock = 0;	// tlock state expected by thread
-		sys_put(SYS_REGS | SYS_COPY | SYS_SNAP | SYS_START, t->tno,
-			&ps, (void*)VM_USERLO, (void*)VM_USERLO,
+		ps.imax = t->quantum;
+		sys_put(SYS_REGS | SYS_COPY | SYS_SIBSNAP | SYS_START | tgroup(),
+			t->tno, &ps, (void*)VM_USERLO, (void*)VM_USERLO,
 			VM_PRIVLO - VM_USERLO);
-		tlock = 2;	// tlock state for master process
 	}
 
 	// Unexpected trap in pthreads code?
@@ -402,6 +470,8 @@ tblock(pthread_t t, int newstate)
 	// Set new thread state
 	assert(newstate != TH_RUN);
 	t->state = newstate;
+	if (newstate == TH_MUTEX || newstate == TH_COND)
+		nwaiting++;
 
 	// Save critical registers and invoke scheduler;
 	// this thread will continue if/when it gets unblocked.
@@ -435,7 +505,10 @@ tready(pthread_t t)
 	assert(t->state != TH_RUN);
 	assert(t->qnext == NULL);
 
+	if (t->state == TH_MUTEX || t->state == TH_COND)
+		nwaiting--;
 	t->state = TH_RUN;
+	tlocks[t->tno] = 2;	// it resumes in the master
 	*readyqtail = t;
 	readyqtail = &t->qnext;
 }
@@ -467,7 +540,7 @@ munlock(void)
 	// because normal instruction atomicity is all we need.
 	char rc;
 	asm volatile("andl $2,%1; setz %0"
-		: "=r" (rc), "=m" (tlock) : : "memory", "cc");
+		: "=r" (rc), "+m" (tlock) : : "memory", "cc");
 	return rc;
 }
 
@@ -513,9 +586,9 @@ mret(void)
 	// and means we don't have to clear it on each use.
 	static procstate ps = {
 		.icnt = 0,
-		.imax = P_QUANTUM,
 	};
 	ps.pff = t->pff | (P_QUANTUM ? PFF_ICNT : 0);
+	ps.imax = t->quantum;
 
 	// Copy our register state and address space to the child,
 	// (re)start the child, and invoke the scheduler in the master process.
@@ -523,19 +596,20 @@ mret(void)
 		"	movq	%%rbp,%0;"	// save thread's ebp
 		"	movq	%%rsp,%1;"	// save thread's esp
 		"	movl	$1f,%2;"	// save thread's eip
-		"	movl	$0,tlock;"	// child must see tlock == 0
-		"	int	%3;"		// INT $T_SYSCALL
-		"	movl	$2,tlock;"	// scheduler sees tlock == 2
-		"	movq	%10,%%rsp;"	// switch to scheduler stack
+		"	movl	$0,%3;"		// child must see tlock == 0
+		"	int	%4;"		// INT $T_SYSCALL
+		"	movq	%11,%%rsp;"	// switch to scheduler stack
 		"	xorq	%%rbp,%%rbp;"	// clear frame pointer
 		"	jmp	pthread_sched;"	// invoke the scheduler
 		"	.p2align 4,0x90;"
 		"1:	"
 		: "=m" (ps.tf.rbp),
 		  "=m" (ps.tf.rsp),
-		  "=m" (ps.tf.rip)
+		  "=m" (ps.tf.rip),
+		  "=m" (tlock)
 		: "i" (T_SYSCALL),
-		  "a" (SYS_PUT | SYS_REGS | SYS_COPY | SYS_SNAP | SYS_START),
+		  "a" (SYS_PUT | SYS_REGS | SYS_COPY | SYS_SIBSNAP | SYS_START
+			| tgroup()),
 		  "d" (t->tno),
 		  "b" (&ps),
 		  "S" (VM_USERLO),
@@ -562,6 +636,7 @@ tinit(pthread_t t)
 	assert(t == &th[tno]);
 	if (tmax <= tno)
 		tmax = tno+1;
+	t->quantum = P_QUANTUM;
 
 	// Set up the new thread's stack and heap.
 	// Leave a 1-page redzone at the bottom of each stack.
@@ -627,6 +702,19 @@ tpinit(pthread_t t)
 	assert(testint == 0x12345678);	// make sure it worked!
 }
 
+// Put a thread's slot on the free list for pthread_create() to reuse.
+// A detached thread does this before blocking for good, so it's still
+// marked TH_RUN here; pthread_create() only runs after it's TH_FREE.
+static void
+tfreeslot(pthread_t t)
+{
+	assert(t->tno > 0);	// thread 0 is the main thread
+	if (t->state == TH_EXIT)
+		t->state = TH_FREE;
+	t->freenext = tfree;
+	tfree = t;
+}
+
 // Initial entrypoint for threads started via pthread_create().
 static gcc_noreturn void
 tstart(void *(*start_routine)(void *), void *arg)
@@ -643,14 +731,17 @@ pthread_create(pthread_t *out_thread, const pthread_attr_t *attr,
 {
 	mcall();
 
-	// Find an available thread slot
+	// Reuse the most recently freed thread slot, else take a new one.
 	int tno;
-	for (tno = 1; ; tno++) {
+	if (tfree != NULL) {
+		tno = tfree->tno;
+		tfree = tfree->freenext;
+	} else {
+		tno = MAX(tmax, 1);
 		if (tno >= MAXTHREADS)
 			panic("pthread_create: too many threads");
-		if (th[tno].state == TH_FREE)
-			break;
 	}
+	assert(th[tno].state == TH_FREE);
 	pthread_t t = &th[tno];
 	memset(t, 0, sizeof(*t));
 	t->tno = tno;
@@ -701,7 +792,7 @@ pthread_join(pthread_t tj, void **out_exitval)
 		*out_exitval = tj->exitval;
 
 	// Free the thread for subsequent reuse
-	tj->state = TH_FREE;
+	tfreeslot(tj);
 
 	mret();
 	return 0;
@@ -722,6 +813,8 @@ pthread_exit(void *exitval)
 	// save our exit status and block until joiner collects it,
 	// or just go to TH_FREE immediately if we're detached.
 	t->exitval = exitval;
+	if (t->detached)
+		tfreeslot(t);	// slot reusable once we've blocked below
 	tblock(t, t->detached ? TH_FREE : TH_EXIT);
 	panic("exited thread should not have unblocked");
 }
@@ -1086,51 +1179,136 @@ int pthread_setspecific(pthread_key_t key, const void *val)
 
 ////////// Memory allocation //////////
 
+// Each thread allocates only from its own THEAP region,
+// carving blocks off a bump pointer and recycling freed blocks
+// through per-size-class free lists, all deterministically.
+// Every block has an 8-byte header holding its size class,
+// and holds (1 << class) bytes including that header.
+// The allocator state of each thread lives in its own region's first pages,
+// so allocating threads never write to each other's pages.
+// A block freed by a thread other than its owner, which we know from
+// the region it lies in, goes onto the freeing thread's outbox for the owner;
+// its link word is in the (dead) block itself, which the owner won't touch.
+// Now and then, when short of free blocks, the owner takes back
+// whatever has been added to other threads' outboxes for it since last time,
+// remembering in its own state how far it got, since the list is theirs.
+// So the merge still never sees two threads writing the same bytes,
+// and blocks go back to the heap they came from.
+#define MINCLASS	4		// smallest block: 16 bytes
+#define NCLASSES	48
+#define MAXBLK		((size_t)1 << (NCLASSES-1))	// largest block
+#define RECLAIMEVERY	64		// free-list misses per outbox check
+
+typedef struct theap {
+	void		*brk;			// end of carved-out blocks
+	void		*hi;			// end of thread's heap region
+	void		*free[NCLASSES];	// free block lists
+	void		*out[MAXTHREADS];	// blocks we freed, by owner
+	void		*seen[MAXTHREADS];	// newest we took of others' out
+	int		nmiss;			// free-list misses so far
+} theap;
+
 extern char end[];
-void *brk[MAXTHREADS];
+static theap *heaps[MAXTHREADS];
+
+static theap *
+theapinit(int tno)
+{
+	// Thread 0 gets an extra large heap.
+	void *lopg = (tno > 0) ? (void*) THEAPLO(tno)
+			: ROUNDUP((void*)end, PAGESIZE);
+	void *hipg = (void*) THEAPHI(tno);
+	assert(hipg > lopg);
+	sys_get(SYS_PERM | SYS_RW, 0, NULL, NULL, lopg, hipg - lopg);
+
+	theap *h = lopg;
+	h->brk = lopg + ROUNDUP(sizeof(theap), PAGESIZE);
+	h->hi = hipg;
+	return heaps[tno] = h;
+}
+
+// Find the size class for a request of size bytes plus the block header,
+// which must not exceed MAXBLK.
+static gcc_inline int
+blkclass(size_t size)
+{
+	assert(size <= MAXBLK - 8);
+	int c = MINCLASS;
+	while (((size_t)1 << c) < size + 8)
+		c++;
+	return c;
+}
+
+// Find which thread's heap region a block lies in.
+static gcc_inline int
+blkowner(void *blk)
+{
+	if ((uintptr_t) blk < HEAPLO)
+		return 0;	// below the rest, in thread 0's extra-large heap
+	return ((uintptr_t) blk - HEAPLO) / THEAPSIZE;
+}
+
+// Take back onto thread tno's free lists the blocks of its
+// that other threads have freed since we last looked.
+static void
+theapreclaim(theap *h, int tno)
+{
+	int t;
+	for (t = 0; t < MAXTHREADS; t++) {
+		theap *o = heaps[t];
+		if (t == tno || o == NULL)
+			continue;
+		void *blk = o->out[tno], *stop = h->seen[t];
+		h->seen[t] = blk;
+		while (blk != stop) {
+			void *next = *(void**)(blk + 8);
+			int c = *(uint64_t*)blk;
+			assert(c >= MINCLASS && c < NCLASSES);
+			*(void**)(blk + 8) = h->free[c];
+			h->free[c] = blk;
+			blk = next;
+		}
+	}
+}
 
 void *
 malloc(size_t size)
 {
-//	mcall();
+	if (size > MAXBLK - 8) {
+		errno = ENOMEM;
+		return NULL;
+	}
 
-	// Allocate the requested memory
 	int tno = selfno();
-	void *ptr = brk[tno];
-	if (ptr == NULL) {
-		// Thread 0 gets an extra large heap.
-		ptr = (tno > 0) ? (void*) THEAPLO(tno) : end;
-		void *lopg = ROUNDUP(ptr, PAGESIZE);
-		void *hipg = (void*) THEAPHI(tno);
-		assert(hipg > lopg);
-		sys_get(SYS_PERM | SYS_RW, 0, NULL, NULL, lopg, hipg - lopg);
+	theap *h = heaps[tno];
+	if (h == NULL)
+		h = theapinit(tno);
+
+	int c = blkclass(size);
+
+	if (h->free[c] == NULL && h->nmiss++ % RECLAIMEVERY == 0)
+		theapreclaim(h, tno);
+	void *blk = h->free[c];
+	if (blk != NULL)
+		h->free[c] = *(void**)(blk + 8);
+	else {
+		blk = h->brk;
+		if ((size_t)(h->hi - blk) < ((size_t)1 << c))
+			panic("malloc: thread %d can't alloc chunk of size %d",
+				tno, size);
+		h->brk = blk + ((size_t)1 << c);
+		*(uint64_t*)blk = c;
 	}
-	assert(ptr >= (void*)end);
-	assert(ptr + size <= (void*)VM_SHAREHI);
-	void *nbrk = ROUNDUP(ptr + 8 + size, 8);
-	if (nbrk > (void*) THEAPHI(tno))
-		panic("malloc: thread %d can't alloc chunk of size %d",
-			tno, size);
-	brk[tno] = nbrk;
-*(uint32_t*)ptr = size;
-ptr += 8;
-//if (size > 1024)
-//	cprintf("thread %d malloc size %d -> %x\n", tno, size, ptr);
-
-//	// Make sure the new memory is accessible
-//	void *pgold = ROUNDUP(ptr, PAGESIZE);
-//	void *pgnew = ROUNDUP(nbrk, PAGESIZE);
-//	if (pgnew > pgold)
-//		sys_get(SYS_PERM | SYS_RW, 0, NULL, NULL, pgold, pgnew - pgold);
-
-//	mret();
-
-	return ptr;
+	return blk + 8;
 }
 
 void *
 calloc(size_t nelt, size_t eltsize)
 {
+	if (eltsize != 0 && nelt > MAXBLK / eltsize) {
+		errno = ENOMEM;
+		return NULL;
+	}
 	size_t size = nelt * eltsize;
 	void *ptr = malloc(size);
 	if (ptr == NULL)
@@ -1144,18 +1322,44 @@ realloc(void *ptr, size_t newsize)
 {
 	if (ptr == NULL)
 		return malloc(newsize);
-	panic("realloc");
+
+	// Stay put if the block's size class still fits.
+	int c = *(uint64_t*)(ptr - 8);
+	size_t oldsize = ((size_t)1 << c) - 8;
+	if (newsize <= oldsize)
+		return ptr;
+
+	void *nptr = malloc(newsize);
+	if (nptr == NULL)
+		return NULL;	// old block stays as it was
+	memcpy(nptr, ptr, oldsize);
+	free(ptr);
+	return nptr;
 }
 
 void
 free(void *ptr)
 {
-	/* DOUBT:: Empty funtion ?*/
+	if (ptr == NULL)
+		return;
 
-//	int size = *(int*)(ptr-8);
-//	if (size > 1024)
-//		cprintf("thread %d free size %d at %x\n",
-//			selfno(), size, ptr);
+	int tno = selfno();
+	theap *h = heaps[tno];
+	if (h == NULL)
+		h = theapinit(tno);
+
+	void *blk = ptr - 8;
+	int c = *(uint64_t*)blk;
+	assert(c >= MINCLASS && c < NCLASSES);
+	int owner = blkowner(blk);
+	assert(owner < MAXTHREADS);
+	if (owner != tno) {		// queue it for its owner
+		*(void**)ptr = h->out[owner];
+		h->out[owner] = blk;
+		return;
+	}
+	*(void**)ptr = h->free[c];
+	h->free[c] = blk;
 }
 
 ////////// Signal handling //////////
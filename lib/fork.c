@@ -27,26 +27,14 @@ bool reconcile(pid_t pid, filestate *cfiles);
 bool reconcile_inode(pid_t pid, filestate *cfiles, int pino, int cino);
 bool reconcile_merge(pid_t pid, filestate *cfiles, int pino, int cino);
 
-pid_t fork(void)
+// Fork child slot as a copy of our entire user address space and start it,
+// adding flags to the SYS_PUT that does so (e.g., SYS_SNAP to merge later).
+// Returns 0 in the child and 1 in the parent.
+// The child resumes here on a copy of our stack and returns normally;
+// the registers it doesn't get from us are saved in our frame first.
+int gcc_noinline
+forkslot(int slot, uint32_t flags)
 {
-	int i;
-
-	// Find a free child process slot.
-	// We just use child process slot numbers as Unix PIDs,
-	// even though child slots are process-local in PIOS
-	// whereas PIDs are global in Unix.
-	// This means that commands like 'ps' and 'kill'
-	// have to be shell-builtin commands under PIOS.
-	pid_t pid;
-	for (pid = 1; pid < 256; pid++)
-		if (files->child[pid].state == PROC_FREE)
-			break;
-	if (pid == 256) {
-		warn("fork: no child process available");
-		errno = EAGAIN;
-		return -1;
-	}
-
 	// Set up the register state for the child
 	struct procstate ps;
 	memset(&ps, 0, sizeof(ps));
@@ -72,28 +60,59 @@ pid_t fork(void)
 		:
 		: "rbx", "rcx", "rdx", "r8", "r9", "r10", "r11",
 		  "r12", "r13", "r14", "r15");
-	if (!isparent) {
+	if (!isparent)
+		return 0;	// in the child
+
+	// Copy our entire user address space into the child and start it.
+	ps.tf.rax = 0;	// isparent == 0 in the child
+	sys_put(SYS_REGS | SYS_COPY | SYS_START | flags, slot, &ps,
+		ALLVA, ALLVA, ALLSIZE);
+	return 1;
+}
+
+// Reset the Unix process state a newly forked child copied from its parent.
+void
+forkinit(void)
+{
+	int i;
+
+	// Clear our child state array, since we have no children yet.
+	memset(&files->child, 0, sizeof(files->child));
+	files->child[0].state = PROC_RESERVED;
+	for (i = 1; i < FILE_INODES; i++)
+		if (fileino_alloced(i)) {
+			files->fi[i].rino = i;	// 1-to-1 mapping
+			files->fi[i].rver = files->fi[i].ver;
+			files->fi[i].rlen = files->fi[i].size;
+		}
+}
+
+pid_t fork(void)
+{
+	// Find a free child process slot.
+	// We just use child process slot numbers as Unix PIDs,
+	// even though child slots are process-local in PIOS
+	// whereas PIDs are global in Unix.
+	// This means that commands like 'ps' and 'kill'
+	// have to be shell-builtin commands under PIOS.
+	pid_t pid;
+	for (pid = 1; pid < 256; pid++)
+		if (files->child[pid].state == PROC_FREE)
+			break;
+	if (pid == 256) {
+		warn("fork: no child process available");
+		errno = EAGAIN;
+		return -1;
+	}
+
+	if (!forkslot(pid, 0)) {
 #if LAB >= 9
 		files->thself = pid;
 #endif
-		// Clear our child state array, since we have no children yet.
-		memset(&files->child, 0, sizeof(files->child));
-		files->child[0].state = PROC_RESERVED;
-		for (i = 1; i < FILE_INODES; i++)
-			if (fileino_alloced(i)) {
-				files->fi[i].rino = i;	// 1-to-1 mapping
-				files->fi[i].rver = files->fi[i].ver;
-				files->fi[i].rlen = files->fi[i].size;
-			}
-
+		forkinit();
 		return 0;	// indicate that we're the child.
 	}
 
-	// Copy our entire user address space into the child and start it.
-	ps.tf.rax = 0;	// isparent == 0 in the child
-	sys_put(SYS_REGS | SYS_COPY | SYS_START, pid, &ps,
-		ALLVA, ALLVA, ALLSIZE);
-
 	// Record the inode generation numbers of all inodes at fork time,
 	// so that we can reconcile them later when we synchronize with it.
 	memset(&files->child[pid], 0, sizeof(files->child[pid]));
@@ -4,6 +4,7 @@
 #include <inc/mman.h>
 
 #include <inc/stdio.h>
+#include <inc/errno.h>
 #include <inc/mmu.h>
 #include <inc/syscall.h>
 
@@ -26,12 +27,34 @@ void * sbrk(intptr_t increment) {
 
 void *mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset)
 {
-	return sbrk(length);
+	void *m = sbrk(length);
+	if (flags & MAP_POPULATE)
+		madvise(m, length, MADV_WILLNEED);
+	return m;
 }
 
+// Give the pages back; sbrk() never reuses their addresses.
 int munmap(void *addr, size_t length)
 {
-	cprintf("unmap addr $x, len %x\n", addr, length);
+	if (PGOFF(addr) != 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	sys_get(SYS_ZERO, 0, NULL, NULL, addr, ROUNDUP(length, PAGESIZE));
+	return 0;
+}
+
+// MADV_WILLNEED asks the kernel to resolve any copy-on-write pages
+// in the range now, e.g., before a parallel phase that writes them all,
+// instead of taking one write fault per page later.
+// Other advice is accepted but ignored.
+int madvise(void *addr, size_t length, int advice)
+{
+	if (advice == MADV_WILLNEED) {
+		char *lo = ROUNDDOWN((char*)addr, PAGESIZE);
+		char *hi = ROUNDUP((char*)addr + length, PAGESIZE);
+		sys_get(SYS_PREFAULT, 0, NULL, NULL, lo, hi - lo);
+	}
 	return 0;
 }
 #endif	// LAB >= 9
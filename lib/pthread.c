@@ -12,6 +12,7 @@
 #include <inc/mmu.h>
 #include <inc/vm.h>
 #include <inc/file.h>
+#include <inc/unistd.h>
 #include <pthread.h>
 
 #define ALLVA		((void*) VM_USERLO)
@@ -20,82 +21,400 @@
 #define SHAREVA		((void*) VM_SHARELO)
 #define SHARESIZE	(VM_SHAREHI - VM_SHARELO)
 
-// Barrier constants.
-#define EXIT_BARRIER	0x80000000 // Highest bit set to indicate sys_ret at barrier.
-#define BARRIER_MASK	0xff
-#define BARRIER_READ(b)	((b) & BARRIER_MASK)
-#define BARRIER_WRITE(b) (EXIT_BARRIER | (b))
+// How a thread or leader stopped, passed to the parent in rdi,
+// with the exit value, barrier number, or command result in rsi.
+#define RET_EXIT	0	// thread returned, or leader command done
+#define RET_BARRIER	1	// thread waiting at a barrier
+#define RET_ERROR	2	// some thread took an unexpected trap
+
+// Threads are kept in a tree of processes.
+// Each process holds up to PTHREAD_FANOUT threads as direct children
+// in child slots 1..PTHREAD_FANOUT, and puts any further threads
+// below up to PTHREAD_FANOUT "leader" children in the following slots.
+// Leaders run no user code; they only fork, join and merge threads
+// on their parent's behalf, and may have leaders of their own.
+// At a barrier all leaders merge their subtrees in parallel
+// and hand the combined result up, so the merge critical path
+// grows with the depth of the tree rather than the number of threads.
+// A thread's path names its slot at each level, lowest byte first.
+//
+// Joined threads are not destroyed but parked as idle workers.
+// The next thread created at that level reuses one,
+// catching it up with a copy of our memory as a fork would;
+// the copy shares whatever page tables are unchanged since its last one.
+#define PTHREAD_FANOUT		8
+#define PTHREAD_MAXDEPTH	4
+#define LEADER(s)		((s) > PTHREAD_FANOUT)
+#define PATH_SLOT(p)		((p) & 0xff)
+#define PATH_REST(p)		((p) >> 8)
+
+// Leaders run their commands on a stack in the thread-private area,
+// since each command brings in a fresh copy of the parent's stack.
+#define LEADER_STACKHI		VM_PRIVHI
+#define LEADER_STACKSIZE	(16*PAGESIZE)
+
+// Commands, passed in a leader's or idle worker's argument registers
+#define LD_CREATE	1	// fork a thread to run start(arg) as id
+#define LD_JOIN		2	// join the thread at path
+#define LD_GATHER	3	// merge count more threads at barrier b
+#define LD_RELEASE	4	// restart all threads stopped at a barrier
+#define LD_RUN		5	// (idle worker) run start(arg) as thread id
+
+// Barrier counts, indexed by pthread_barrier_t,
+// at the bottom of the shared area so that they reach every thread
+// with the shared area's merges and copies, wherever it is in the tree.
+#define BARRIERS	((int *) VM_SHARELO)
+#define BARRIERSIZE	ROUNDUP(BARRIER_MAX * sizeof(int), PAGESIZE)
+
+// Our part of the thread tree, in the thread-private area:
+// a leader is refreshed with a copy of all the rest of its parent's memory
+// before each thread it creates, and must keep track of its own children.
+typedef struct ptree {
+	int	depth;				// Depth in our root's tree
+	int	state[2*PTHREAD_FANOUT+1];	// PROC_* state of each slot
+	int	load[2*PTHREAD_FANOUT+1];	// threads below each leader
+	int	arr[2*PTHREAD_FANOUT+1];	// of those, at a barrier
+} ptree;
+#define PT		((ptree *) VM_PRIVLO)
+
+static void ptree_leader(long cmd, long a, long b, long c);
+static void ptree_run(void *(*start_routine)(void *), void *arg, int id);
+
+
+// Return to our parent, passing how we stopped and a value.
+// SYS_RET itself needs rdx clear, so we use rdi and rsi.
+static void gcc_inline
+ptree_ret(int kind, intptr_t val)
+{
+	asm volatile("int %0" : :
+		"i" (T_SYSCALL),
+		"a" (SYS_RET),
+		"d" (0),
+		"D" ((intptr_t) kind),
+		"S" (val)
+		: "cc", "memory");
+}
+
+// Map the pages holding barrier counts and our part of the tree.
+// Mapping them again keeps their contents,
+// and threads inherit both with the rest of our memory.
+static void
+ptree_setup(void)
+{
+	static_assert(sizeof(ptree) <= PAGESIZE);
+	sys_get(SYS_PERM | SYS_RW, 0, NULL, NULL, BARRIERS, BARRIERSIZE);
+	sys_get(SYS_PERM | SYS_RW, 0, NULL, NULL, PT, PAGESIZE);
+}
+
+// Reset the per-process state we copied from our parent.
+static void
+ptree_init(void)
+{
+	forkinit();
+	memset(files->thpath, 0, sizeof(files->thpath));
+	memset(PT->state, 0, sizeof(PT->state));
+	memset(PT->load, 0, sizeof(PT->load));
+	memset(PT->arr, 0, sizeof(PT->arr));
+}
+
+// Run start_routine(arg) as thread id, in a new or reused child.
+static void
+ptree_run(void *(*start_routine)(void *), void *arg, int id)
+{
+	ptree_init();
+	PT->depth = 0;		// root of any threads we create
+	files->thself = id;	// selects our thmalloc arena
+	files->thstat = (void *) (intptr_t) id; // for pthread_self
+	files->thstat = start_routine(arg);
+	ptree_ret(RET_EXIT, (intptr_t) files->thstat);
+	panic("pthread resumed after exiting");
+}
+
+// Fork a thread running start_routine(arg) into child slot,
+// or a leader if start_routine is NULL.
+static void
+ptree_spawn(int slot, void *(*start_routine)(void *), void *arg, int id)
+{
+	// Fork the child, copying our entire user address space into it.
+	if (!forkslot(slot, SYS_SNAP)) {	// in the child
+		// Map the stack we will run later commands on.
+		sys_get(SYS_PERM | SYS_RW, 0, NULL, NULL,
+			(void*) (LEADER_STACKHI - LEADER_STACKSIZE),
+			LEADER_STACKSIZE);
+		if (start_routine != NULL)
+			ptree_run(start_routine, arg, id);
+
+		// A leader: wait for commands
+		ptree_init();
+		PT->depth++;
+		ptree_ret(RET_EXIT, 0);
+		panic("pthread leader resumed without a command");
+	}
+
+	// Record the inode generation numbers of all inodes at fork time,
+	// so that we can reconcile them later when we synchronize with it.
+	memset(&files->child[slot], 0, sizeof(files->child[slot]));
+	files->child[slot].state = PROC_FORKED;
+	PT->state[slot] = PROC_FORKED;
+	PT->load[slot] = PT->arr[slot] = 0;
+}
+
+// Start a command in the leader or idle worker in child slot,
+// giving it a fresh copy of our shared area to work in.
+// All leaders and restarted threads share one reference snapshot
+// as long as our shared area doesn't change in between.
+static void
+ptree_cmd(int slot, int cmd, long a, long b, long c)
+{
+	struct procstate ps;
+	sys_get(SYS_REGS, slot, &ps, NULL, NULL, 0);
+	ps.tf.rip = (intptr_t) ptree_leader;
+	ps.tf.rsp = LEADER_STACKHI - 8;		// as if just called
+	ps.tf.rdi = cmd;
+	ps.tf.rsi = a;
+	ps.tf.rdx = b;
+	ps.tf.rcx = c;
+
+	// A reused worker picks up where a freshly forked thread would,
+	// on a copy of our stack just below our frame.
+	if (cmd == LD_RUN) {
+		uintptr_t sp;
+		asm volatile("movq %%rsp,%0" : "=r" (sp));
+		ps.tf.rsp = ROUNDDOWN(sp - 128, 16) - 8;	// skip red zone
+	}
+
+	// A reused worker must see all our memory as a forked thread would,
+	// and a leader forks the thread from its own memory;
+	// so bring either up to date with everything of ours
+	// short of the thread-private area with its stack and tree.
+	// Page tables unchanged since the last copy stay shared.
+	if (cmd == LD_CREATE || cmd == LD_RUN)
+		sys_put(SYS_COPY, slot, NULL, (void*) VM_USERLO,
+			(void*) VM_USERLO, VM_PRIVLO - VM_USERLO);
+
+	// Leaders released from a barrier start out as one gang
+	// with the threads we release ourselves.
+	sys_put(SYS_REGS | SYS_COPY | SYS_SIBSNAP | SYS_START
+		| (cmd == LD_RELEASE ? SYS_GANG : 0), slot,
+		&ps, SHAREVA, SHAREVA, SHARESIZE);
+}
+
+// Wait for the thread or leader in child slot to stop,
+// merging its changes to the shared area if requested.
+// Returns how it stopped, with the value it passed in *val.
+static int
+ptree_wait(int slot, bool merge, intptr_t *val)
+{
+	struct procstate ps;
+	if (merge)
+		sys_get(SYS_MERGE | SYS_REGS, slot, &ps,
+			SHAREVA, SHAREVA, SHARESIZE);
+	else
+		sys_get(SYS_REGS, slot, &ps, NULL, NULL, 0);
+
+	// Make sure the child exited with the expected trap number
+	if (ps.tf.trapno != T_SYSCALL) {
+		cprintf("  rip  0x%016x\n", ps.tf.rip);
+		cprintf("  rsp  0x%016x\n", ps.tf.rsp);
+		cprintf("join: unexpected trap %d, expecting %d\n",
+			ps.tf.trapno, T_SYSCALL);
+		if (LEADER(slot))
+			panic("pthread leader %d died", slot);
+		*val = -1;
+		return RET_ERROR;
+	}
+	*val = ps.tf.rsi;
+	return ps.tf.rdi;
+}
+
+// Create a thread somewhere in our subtree,
+// returning its path or 0 if the subtree is full.
+static int
+ptree_create(void *(*start_routine)(void *), void *arg, int id)
+{
+	int s, best = 0;
+
+	for (s = 1; s <= PTHREAD_FANOUT; s++)
+		if (PT->state[s] == PROC_IDLE) {
+			PT->state[s] = PROC_FORKED;
+			ptree_cmd(s, LD_RUN, (intptr_t) start_routine,
+				(intptr_t) arg, id);
+			return s;
+		}
+	for (s = 1; s <= PTHREAD_FANOUT; s++)
+		if (PT->state[s] == PROC_FREE) {
+			ptree_spawn(s, start_routine, arg, id);
+			return s;
+		}
+	if (PT->depth >= PTHREAD_MAXDEPTH - 1)
+		return 0;
+
+	// Put it below the least-loaded leader, creating leaders as needed.
+	for (s = PTHREAD_FANOUT + 1; s <= 2 * PTHREAD_FANOUT; s++)
+		if (best == 0 || PT->load[s] < PT->load[best])
+			best = s;
+	if (PT->state[best] == PROC_FREE)
+		ptree_spawn(best, NULL, NULL, 0);
+
+	intptr_t sub;
+	ptree_cmd(best, LD_CREATE, (intptr_t) start_routine, (intptr_t) arg, id);
+	ptree_wait(best, false, &sub);
+	if (sub == 0)
+		return 0;
+	PT->load[best]++;
+	return best | (sub << 8);
+}
+
+// Wait for the thread at path and merge its changes into our shared area,
+// parking it as an idle worker unless it stopped at a barrier.
+static int
+ptree_join(int path, intptr_t *val)
+{
+	int s = PATH_SLOT(path);
+	int kind;
+
+	if (LEADER(s)) {
+		ptree_cmd(s, LD_JOIN, PATH_REST(path), 0, 0);
+		kind = ptree_wait(s, true, val);
+		if (kind == RET_BARRIER)
+			PT->arr[s]++;
+		else
+			PT->load[s]--;
+		return kind;
+	}
+
+	kind = ptree_wait(s, true, val);
+	if (kind == RET_BARRIER) {
+		PT->state[s] = PROC_BARRIER;
+		return kind;
+	}
+	if (kind == RET_EXIT) {
+		PT->state[s] = PROC_IDLE;
+		return kind;
+	}
+	sys_put(SYS_ZERO, s, NULL, ALLVA, ALLVA, ALLSIZE);
+	files->child[s].state = PROC_FREE;
+	PT->state[s] = PROC_FREE;
+	return kind;
+}
+
+// Merge count more threads of our subtree that are stopping at barrier b,
+// returning how many we found or -1 if one took an unexpected trap.
+// Leaders get their share first, so that they merge in parallel
+// with each other and with our merging our own threads.
+static int
+ptree_gather(int count, int b)
+{
+	int share[2 * PTHREAD_FANOUT + 1];
+	int s, got = 0, err = 0;
+	intptr_t val;
+
+	memset(share, 0, sizeof(share));
+	for (s = 1; s <= 2 * PTHREAD_FANOUT && count > 0; s++) {
+		if (PT->state[s] != PROC_FORKED)
+			continue;
+		share[s] = LEADER(s) ?
+			MIN(PT->load[s] - PT->arr[s], count) : 1;
+		count -= share[s];
+		if (LEADER(s) && share[s] > 0)
+			ptree_cmd(s, LD_GATHER, share[s], b, 0);
+	}
 
+	for (s = 1; s <= PTHREAD_FANOUT; s++) {
+		if (share[s] == 0)
+			continue;
+		if (ptree_wait(s, true, &val) != RET_BARRIER) {
+			err = 1;
+			continue;
+		}
+		// This should be the same barrier;
+		assert(val == b);
+		PT->state[s] = PROC_BARRIER;
+		got++;
+	}
+
+	for (s = PTHREAD_FANOUT + 1; s <= 2 * PTHREAD_FANOUT; s++) {
+		if (share[s] == 0)
+			continue;
+		if (ptree_wait(s, true, &val) == RET_ERROR)
+			err = 1;
+		PT->arr[s] += val;
+		got += val;
+	}
+	return err ? -1 : got;
+}
+
+// Restart every thread in our subtree stopped at a barrier.
+// Since they all resume from the same state,
+// they can all share one reference snapshot of the shared area,
+// and the kernel schedules them as a gang to reach the next one together.
+static void
+ptree_release(void)
+{
+	int s;
+	for (s = 1; s <= 2 * PTHREAD_FANOUT; s++) {
+		if (PT->state[s] == PROC_BARRIER) {
+			PT->state[s] = PROC_FORKED;
+			sys_put(SYS_COPY | SYS_SIBSNAP | SYS_START | SYS_GANG,
+				s, NULL, SHAREVA, SHAREVA, SHARESIZE);
+		} else if (LEADER(s) && PT->arr[s] > 0) {
+			PT->arr[s] = 0;
+			ptree_cmd(s, LD_RELEASE, 0, 0, 0);
+		}
+	}
+}
+
+// Entrypoint for each command our parent gives us as a leader.
+static void
+ptree_leader(long cmd, long a, long b, long c)
+{
+	intptr_t val = 0;
+	int kind = RET_EXIT;
+
+	switch (cmd) {
+	case LD_CREATE:
+		val = ptree_create((void *(*)(void *)) a, (void *) b, c);
+		break;
+	case LD_JOIN:
+		kind = ptree_join(a, &val);
+		break;
+	case LD_GATHER:
+		val = ptree_gather(a, b);
+		if (val < 0)
+			kind = RET_ERROR, val = 0;
+		break;
+	case LD_RELEASE:
+		ptree_release();
+		break;
+	case LD_RUN:
+		ptree_run((void *(*)(void *)) a, (void *) b, c);
+	default:
+		panic("pthread leader: unknown command %d", cmd);
+	}
+	ptree_ret(kind, val);
+	panic("pthread leader resumed without a command");
+}
 
-// Fork a child process, returning 0 in the child and 1 in the parent.
+
+// Fork a thread, placing it in our tree of child processes.
 int
 pthread_create(pthread_t *out_thread, const pthread_attr_t *attr,
 		void *(*start_routine)(void *), void *arg)
 {
 	pthread_t th;
-	int i;
+	ptree_setup();
 
-	// Find a free child thread/process slot.
+	// Find a free thread id.
 	for (th = 1; th < PROC_CHILDREN; th++)
-		if (files->child[th].state == PROC_FREE)
+		if (files->thpath[th] == 0)
 			break;
-	if (th == 256) {
+	if (th == PROC_CHILDREN ||
+	    (files->thpath[th] = ptree_create(start_routine, arg, th)) == 0) {
 		warn("pthread_create: no child available");
 		errno = EAGAIN;
 		return -1;
 	}
 
-	// Set up the register state for the child
-	struct procstate ps;
-	memset(&ps, 0, sizeof(ps));
-
-	// Use some assembly magic to propagate registers to child
-	// and generate an appropriate starting eip
-	int isparent;
-	asm volatile(
-		"	movq	%%rsi,%0;"
-		"	movq	%%rdi,%1;"
-		"	movq	%%rbp,%2;"
-		"	movq	%%rsp,%3;"
-		"	movq	$1f,%4;"
-		"	movl	$1,%5;"
-		"1:	"
-		: "=m" (ps.tf.rsi),
-		  "=m" (ps.tf.rdi),
-		  "=m" (ps.tf.rbp),
-		  "=m" (ps.tf.rsp),
-		  "=m" (ps.tf.rip),
-		  "=a" (isparent)
-		:
-		: "rbx", "rcx", "rdx", "r8", "r9", "r10", "r11",
-		  "r12", "r13", "r14", "r15");
-	if (!isparent) {	// in the child
-		// Clear our child state array, since we have no children yet.
-		memset(&files->child, 0, sizeof(files->child));
-		files->child[0].state = PROC_RESERVED;
-		for (i = 1; i < FILE_INODES; i++)
-			if (fileino_alloced(i)) {
-				files->fi[i].rino = i;	// 1-to-1 mapping
-				files->fi[i].rver = files->fi[i].ver;
-				files->fi[i].rlen = files->fi[i].size;
-			}
-
-		files->thstat = (void *)th; // for pthread_self
- 		files->thstat = start_routine(arg);
-		asm volatile("	movl	%0, %%edx" : : "m" (files->thstat));
-		sys_ret();
-	}
-
-	// Fork the child, copying our entire user address space into it.
-	ps.tf.rax = 0;	// isparent == 0 in the child
-	sys_put(SYS_START | SYS_SNAP | SYS_REGS | SYS_COPY, th,
-		&ps, ALLVA, ALLVA, ALLSIZE);
-
-	// Record the inode generation numbers of all inodes at fork time,
-	// so that we can reconcile them later when we synchronize with it.
-	memset(&files->child[th], 0, sizeof(files->child[th]));
-	files->child[th].state = PROC_FORKED;
-
 	*out_thread = th;
 	return 0;
 }
@@ -104,39 +423,12 @@ pthread_create(pthread_t *out_thread, const pthread_attr_t *attr,
 int
 wait_at_barrier(pthread_t first_child, pthread_barrier_t barrier)
 {
-
 	// Get the number of threads to wait at this barrier.
 	// One has already arrived, so subtract 1.
-	int count = files->barriers[barrier];
-	int status, i;
-	struct procstate ps;
-	pthread_t th;
-	pthread_t threads[PROC_CHILDREN];
-	i = 0;
-	threads[i++] = first_child;
-	for  (th = 1; th < PROC_CHILDREN && i < count; th++) {
-
-		if (th == first_child || files->child[th].state != PROC_FORKED)
-			continue;
-
-		sys_get(SYS_MERGE | SYS_REGS, th, &ps, SHAREVA, SHAREVA, SHARESIZE);
-
-		// Make sure the child exited with the expected trap number
-		if (ps.tf.trapno != T_SYSCALL) {
-			cprintf("  rip  0x%016x\n", ps.tf.rip);
-			cprintf("  rsp  0x%016x\n", ps.tf.rsp);
-			cprintf("join: unexpected trap %d, expecting %d\n",
-				ps.tf.trapno, T_SYSCALL);
-			errno = EINVAL;
-			return -1;
-		}
-		status = ps.tf.rdx;
-
-		// This should be the same barrier;
-		assert(barrier == BARRIER_READ(status));
-
-		threads[i++] = th;
-	}
+	int count = BARRIERS[barrier];
+	int i = 1 + ptree_gather(count - 1, barrier);
+	if (i == 0)
+		return -1;	// some thread trapped
 
 	// Wrong count or not enough forked threads: error.
 	if (i < count) {
@@ -144,11 +436,8 @@ wait_at_barrier(pthread_t first_child, pthread_barrier_t barrier)
 		return i;
 	}
 
-	// Synchronize memory with all children.
-	// Restart all children.
-	for (i = 0; i < count; i++)
-		sys_put( SYS_COPY | SYS_SNAP | SYS_START, threads[i],
-			 NULL, SHAREVA, SHAREVA, SHARESIZE);
+	// Synchronize memory with all children and restart them.
+	ptree_release();
 	return 0;
 }
 
@@ -163,28 +452,23 @@ pthread_join(pthread_t th, void **out_exitval)
 	// If this is a barrier, wait until all children have arrived,
 	// then restart them all.
 	// If this is not a barrier, free the child.
-	int status, ret;
-	struct procstate ps;
+	int kind, ret;
+	intptr_t status;
+	if (th <= 0 || th >= PROC_CHILDREN || files->thpath[th] == 0) {
+		errno = ESRCH;
+		return -1;
+	}
 	while(true) {
-		sys_get(SYS_MERGE | SYS_REGS, th, &ps, SHAREVA, SHAREVA, SHARESIZE);
-
-		// Make sure the child exited with the expected trap number
-		if (ps.tf.trapno != T_SYSCALL) {
-			cprintf("  rip  0x%016x\n", ps.tf.rip);
-			cprintf("  rsp  0x%016x\n", ps.tf.rsp);
-			cprintf("join: unexpected trap %d, expecting %d\n",
-				ps.tf.trapno, T_SYSCALL);
-			status = -1;
+		kind = ptree_join(files->thpath[th], &status);
+		if (kind == RET_ERROR) {
 			errno = EINVAL;
 			ret = -1;
 			goto done;
 		}
 
-		status = ps.tf.rdx;
-
 		// At a barrier?
-		if (status & EXIT_BARRIER) {
-			ret = wait_at_barrier(th, BARRIER_READ(status));
+		if (kind == RET_BARRIER) {
+			ret = wait_at_barrier(th, status);
 			if (ret == -1) {
 				errno = EINVAL;
 				goto done;
@@ -205,14 +489,14 @@ pthread_join(pthread_t th, void **out_exitval)
 	if (out_exitval != NULL)
 		*out_exitval = (void *)status;
 	files->thstat = NULL;
-	sys_put(SYS_ZERO, th, NULL, ALLVA, ALLVA, ALLSIZE);
-	files->child[th].state = PROC_FREE;
+	if (kind != RET_BARRIER)
+		files->thpath[th] = 0;
 	return ret;
 }
 
 
-int 
-pthread_barrier_init(pthread_barrier_t * barrier, 
+int
+pthread_barrier_init(pthread_barrier_t * barrier,
 			 const pthread_barrierattr_t * attr,
 			 unsigned int count)
 {
@@ -221,9 +505,10 @@ pthread_barrier_init(pthread_barrier_t * barrier,
 		errno = EINVAL;
 		return -1;
 	}
+	ptree_setup();
 
 	for (b = 0; b < BARRIER_MAX; b++)
-		if (files->barriers[b] == 0) 
+		if (BARRIERS[b] == 0)
 			break;
 
 	if (b == BARRIER_MAX) {
@@ -232,18 +517,18 @@ pthread_barrier_init(pthread_barrier_t * barrier,
 	}
 
 	*barrier = b;
-	files->barriers[b] = count;
+	BARRIERS[b] = count;
 	return 0;
 }
 
-int 
+int
 pthread_barrier_destroy(pthread_barrier_t * barrier)
 {
 	if (*barrier < 0 || *barrier >= BARRIER_MAX) {
 		errno = EINVAL;
 		return -1;
 	}
-	files->barriers[*barrier] = 0;
+	BARRIERS[*barrier] = 0;
 	return 0;
 }
 
@@ -253,14 +538,12 @@ pthread_barrier_wait(pthread_barrier_t * barrier)
 	// Reject if null or presumably uninitialized.
 
 	if ((barrier == NULL) ||
-	    (files->barriers[*barrier] <= 0)) {
+	    (BARRIERS[*barrier] <= 0)) {
 		errno = EINVAL;
 		return -1;
 	}
 
-	uint32_t b = BARRIER_WRITE(*barrier);
-	asm volatile("	movl	%0, %%edx" : : "m" (b));
-	sys_ret();
+	ptree_ret(RET_BARRIER, *barrier);
 	return 0;
 }
 
@@ -269,7 +552,7 @@ pthread_t pthread_self(void)
 {
 	// Conforms to common expectations of the
 	// first thread having ID 0.
-	return (int)files->thstat - 1; 
+	return (int)files->thstat - 1;
 }
 
 
@@ -0,0 +1,249 @@
+#if LAB >= 9
+// Deterministic fork/join tasks.
+//
+// task_sync() deals a group's tasks out to up to taskcpus worker processes,
+// each with its own deque: a contiguous range of the group's tasks.
+// A worker is sent the front half of its deque at a time.
+// The parent then visits the workers in a fixed order, merging each one's
+// results and refilling it from its deque, or, once that is empty,
+// by stealing the back half of the largest remaining deque.
+// Since the visiting order is fixed, so is every stealing decision;
+// and since tasks of a group write disjoint memory,
+// which worker ran a task never shows in the merged result anyway.
+// That last fact also lets a process running with PFF_NONDET
+// visit whichever worker finishes first instead, via sys_getany(),
+// so that one slow task no longer holds up refilling the others.
+//
+// Workers are kept parked between syncs and caught up with a copy of all
+// our memory when reused, which shares the page tables unchanged since
+// their last copy, so that a later sync costs about the changes since
+// rather than a fork.
+
+#include <inc/stdio.h>
+#include <inc/string.h>
+#include <inc/assert.h>
+#include <inc/syscall.h>
+#include <inc/vm.h>
+#include <inc/file.h>
+#include <inc/unistd.h>
+#include <inc/task.h>
+
+typedef struct worker {
+	int		slot;		// child process number
+	int		lo, hi;		// our deque of not yet started tasks
+	int		ncpu;		// budget for the tasks' own syncs
+	bool		running;
+} worker;
+
+
+// Are we running with PFF_NONDET?  Only then does the kernel let
+// a child we put the flag into keep it; so try a spare one and look.
+static bool
+task_nondet(void)
+{
+	struct procstate ps;
+	int slot;
+
+	for (slot = PROC_CHILDREN-1; slot > 0; slot--)
+		if (files->child[slot].state == PROC_FREE)
+			break;
+	if (slot == 0)
+		return false;
+	memset(&ps, 0, sizeof(ps));
+	ps.pff = PFF_NONDET;
+	sys_put(SYS_REGS, slot, &ps, NULL, NULL, 0);
+	sys_get(SYS_REGS, slot, &ps, NULL, NULL, 0);
+	return (ps.pff & PFF_NONDET) != 0;
+}
+
+// Set how many CPUs this process's task_sync() may keep busy.
+// Workers split it among themselves for any groups their tasks sync.
+void
+task_init(int ncpu)
+{
+	assert(ncpu > 0);
+	files->taskcpus = ncpu;
+	files->taskany = task_nondet();
+}
+
+void
+task_spawn(taskgroup *g, void (*fn)(void *), void *arg)
+{
+	if (g->ntask == TASK_MAX)
+		task_sync(g);
+	g->task[g->ntask].fn = fn;
+	g->task[g->ntask].arg = arg;
+	g->ntask++;
+}
+
+// Entrypoint in a worker: run tasks [lo,hi) of g and go back to sleep.
+static void
+task_run(taskgroup *g, int lo, int hi, int ncpu)
+{
+	forkinit();	// we got our parent's files and children with its memory
+	files->taskcpus = ncpu;
+	for (; lo < hi; lo++)
+		g->task[lo].fn(g->task[lo].arg);
+	sys_ret();
+	panic("task_run: worker resumed without work");
+}
+
+// Find a parked worker, or fork a new one that parks right away.
+static int
+task_worker(void)
+{
+	int slot;
+
+	for (slot = 1; slot < PROC_CHILDREN; slot++)
+		if (files->child[slot].state == PROC_IDLE)
+			goto found;
+	for (slot = 1; slot < PROC_CHILDREN; slot++)
+		if (files->child[slot].state == PROC_FREE)
+			break;
+	if (slot == PROC_CHILDREN)
+		return 0;
+
+	if (!forkslot(slot, SYS_SNAP)) {	// in the child
+		sys_ret();
+		panic("task_worker: worker resumed without work");
+	}
+
+found:
+	files->child[slot].state = PROC_FORKED;
+	return slot;
+}
+
+// Send worker w the front half of its deque.
+// It runs on a copy of our stack just below our frame,
+// where g and the tasks' arguments are, and a fresh copy of all our memory
+// short of the thread-private area, as a newly forked worker would.
+static void
+task_dispatch(taskgroup *g, worker *w)
+{
+	int n = (w->hi - w->lo + 1) / 2;
+	uintptr_t sp;
+	struct procstate ps;
+
+	sys_get(SYS_REGS, w->slot, &ps, NULL, NULL, 0);
+	asm volatile("movq %%rsp,%0" : "=r" (sp));
+	ps.tf.rip = (intptr_t) task_run;
+	ps.tf.rsp = ROUNDDOWN(sp - 128, 16) - 8;	// skip red zone
+	ps.tf.rdi = (intptr_t) g;
+	ps.tf.rsi = w->lo;
+	ps.tf.rdx = w->lo + n;
+	ps.tf.rcx = w->ncpu;
+	if (files->taskany)
+		ps.pff |= PFF_NONDET;	// so its own syncs can wait for any
+	w->lo += n;
+	w->running = true;
+
+	sys_put(SYS_COPY, w->slot, NULL, (void*) VM_USERLO,
+		(void*) VM_USERLO, VM_PRIVLO - VM_USERLO);
+	sys_put(SYS_REGS | SYS_COPY | SYS_SIBSNAP | SYS_START, w->slot,
+		&ps, SHAREVA, SHAREVA, SHARESIZE);
+}
+
+// Check that a worker we've gotten stopped by finishing its tasks.
+static void
+task_check(worker *w, struct procstate *ps)
+{
+	if (ps->tf.trapno != T_SYSCALL) {
+		cprintf("  rip  0x%016x\n", ps->tf.rip);
+		cprintf("  rsp  0x%016x\n", ps->tf.rsp);
+		panic("task_sync: unexpected trap %d, expecting %d\n",
+			ps->tf.trapno, T_SYSCALL);
+	}
+	w->running = false;
+}
+
+// Wait for worker w and merge the results of the tasks it ran.
+static void
+task_wait(worker *w)
+{
+	struct procstate ps;
+	sys_get(SYS_MERGE | SYS_REGS, w->slot, &ps,
+		SHAREVA, SHAREVA, SHARESIZE);
+	task_check(w, &ps);
+}
+
+// Wait for whichever of the nw workers w finishes first,
+// merge the results of the tasks it ran, and return its index.
+static int
+task_waitany(worker *w, int nw)
+{
+	uint8_t set[PROC_CHILDREN/8];
+	struct procstate ps;
+	int j;
+
+	memset(set, 0, sizeof(set));
+	for (j = 0; j < nw; j++)
+		if (w[j].running)
+			set[w[j].slot / 8] |= 1 << (w[j].slot % 8);
+	int slot = sys_getany(SYS_MERGE | SYS_REGS, set, &ps,
+				SHAREVA, SHAREVA, SHARESIZE);
+	for (j = 0; j < nw; j++)
+		if (w[j].running && w[j].slot == slot)
+			break;
+	if (j == nw)
+		panic("task_sync: got child %d, not a running worker", slot);
+	task_check(&w[j], &ps);
+	return j;
+}
+
+// Run all tasks spawned into g, returning when they have all finished
+// and their changes to the shared area have been merged into ours.
+void
+task_sync(taskgroup *g)
+{
+	worker w[PROC_CHILDREN];
+	int n = g->ntask, ncpu = MAX(files->taskcpus, 1);
+	int nw = MIN(n, ncpu), busy = 0, i, j, k;
+
+	g->ntask = 0;
+	if (nw <= 1) {
+		for (i = 0; i < n; i++)
+			g->task[i].fn(g->task[i].arg);
+		return;
+	}
+
+	// Deal the tasks out evenly, and the CPUs along with them.
+	for (j = 0; j < nw; j++) {
+		w[j].lo = n * j / nw;
+		w[j].hi = n * (j + 1) / nw;
+		w[j].ncpu = ncpu / nw + (j < ncpu % nw);
+		w[j].slot = task_worker();
+		if (w[j].slot == 0)
+			panic("task_sync: no child available");
+		task_dispatch(g, &w[j]);
+		busy++;
+	}
+
+	for (j = 0; busy > 0; j = (j + 1) % nw) {
+		if (files->taskany)
+			j = task_waitany(w, nw);
+		else if (w[j].running)
+			task_wait(&w[j]);
+		else
+			continue;
+		busy--;
+
+		// Out of work?  Steal from the largest deque.
+		if (w[j].lo == w[j].hi) {
+			for (k = 0, i = 1; i < nw; i++)
+				if (w[i].hi - w[i].lo > w[k].hi - w[k].lo)
+					k = i;
+			int steal = (w[k].hi - w[k].lo + 1) / 2;
+			w[j].hi = w[k].hi;
+			w[j].lo = w[k].hi -= steal;
+		}
+		if (w[j].lo < w[j].hi) {
+			task_dispatch(g, &w[j]);
+			busy++;
+		}
+	}
+
+	for (j = 0; j < nw; j++)
+		files->child[w[j].slot].state = PROC_IDLE;
+}
+
+#endif	// LAB >= 9
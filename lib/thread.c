@@ -23,11 +23,9 @@
 #include <inc/errno.h>
 #if LAB >= 9
 #include <inc/pthread.h>
+#include <inc/dlmalloc.h>
 #endif
 
-#define ALLVA		((void*) VM_USERLO)
-#define ALLSIZE		(VM_USERHI - VM_USERLO)
-
 #define SHAREVA		((void*) VM_SHARELO)
 #define SHARESIZE	(VM_SHAREHI - VM_SHARELO)
 
@@ -41,41 +39,18 @@ static int thread_id;
 int
 tfork(uint16_t child)
 {
-	// Set up the register state for the child
-	struct procstate ps;
-	memset(&ps, 0, sizeof(ps));
-
-	// Use some assembly magic to propagate registers to child
-	// and generate an appropriate starting eip
-	int isparent;
-	asm volatile(
-		"	movq	%%rsi,%0;"
-		"	movq	%%rdi,%1;"
-		"	movq	%%rbp,%2;"
-		"	movq	%%rsp,%3;"
-		"	movq	$1f,%4;"
-		"	movl	$1,%5;"
-		"1:	"
-		: "=m" (ps.tf.rsi),
-		  "=m" (ps.tf.rdi),
-		  "=m" (ps.tf.rbp),
-		  "=m" (ps.tf.rsp),
-		  "=m" (ps.tf.rip),
-		  "=a" (isparent)
-		:
-		: "rbx", "rcx", "rdx");
-	if (!isparent) {
+#if LAB >= 9
+	// Give the child its own malloc arena before it is copied.
+	thfork(child);
+#endif
+
+	// Fork the child, copying our entire user address space into it.
+	if (!forkslot(child, SYS_SNAP)) {
 #if LAB >= 9
 		files->thself = child;
 #endif
 		return 0;	// in the child
 	}
-
-	// Fork the child, copying our entire user address space into it.
-	ps.tf.rax = 0;	// isparent == 0 in the child
-	sys_put(SYS_REGS | SYS_COPY | SYS_SNAP | SYS_START, child,
- 		&ps, ALLVA, ALLVA, ALLSIZE);
-
 	return 1;
 }
 
@@ -103,79 +78,68 @@ tresume(uint16_t child)
 {
 	// Restart a child after it has stopped.
 	// Refresh child's memory state to match parent's.
-	sys_put( SYS_COPY | SYS_SNAP | SYS_START, child,
+	// Children resumed back-to-back share one reference snapshot,
+	// and run as a gang so none lags behind at the next barrier.
+	sys_put( SYS_COPY | SYS_SIBSNAP | SYS_START | SYS_GANG, child,
 		 NULL, SHAREVA, SHAREVA, SHARESIZE);
 }
 
-typedef struct internal_args_t {
-	int num_children;
-	void * start_routine;
-	void * args;
-	int * status_array;
-} internal_args_t;
+// Parallel regions started by tparallel_begin and not yet ended.
+// The region's threads are our own pthreads, so that successive regions
+// reuse the same parked workers instead of forking new ones each time.
+#define TPARALLEL_MAX	8
 
-
-void *
-tparallel_internal(void * args_ptr)
-{
-
-	internal_args_t * args = (internal_args_t *)args_ptr;
-	pthread_t threads[PROC_CHILDREN];
-	int cn, ret;
-	assert(args->num_children > 0);
-	assert(args->num_children < PROC_CHILDREN);
-	for (cn = 1; cn < PROC_CHILDREN; cn++)
-		assert(files->child[cn].state == PROC_FREE);
-	for (cn = 0; cn < args->num_children; cn++) {
-		ret = pthread_create(&threads[cn], NULL, args->start_routine, args->args);
-		if (ret != 0) {
-			warn("tparallel_internal: thread creation failure");
-			return (void *)EXIT_FAILURE;
-		}
-	}
-	for (cn = 0; cn < args->num_children; cn++) {
-		ret = pthread_join(threads[cn], (void **)&args->status_array[cn]);
-		if (ret != 0) {
-			warn("tparallel_internal: thread joining failure");
-			return (void *)EXIT_FAILURE;
-		}
-
-	}
-	return (void *)EXIT_SUCCESS;
-}
+static struct tparallel {
+	int		nth;		// number of threads, 0 if slot is free
+	int *		status;		// where to store their exit statuses
+	pthread_t	th[PROC_CHILDREN];
+} tpar[TPARALLEL_MAX];
 
 
 void
 tparallel_begin(int * master, int num_children, void * (* start_routine)(void *), void * args,
 		int status_array[]) 
 {
-
-	internal_args_t internal_args;
-	int ret;
-	internal_args.num_children = num_children;
-	internal_args.start_routine = start_routine;
-	internal_args.args = args;
-	internal_args.status_array = status_array;
-	ret = pthread_create((pthread_t *)master, NULL, &tparallel_internal, &internal_args);
-	if (ret != 0) {
-		fprintf(stderr, "tparallel_begin: thread creation failure: %d\n", errno);
+	struct tparallel *tp;
+	int m, cn;
+
+	assert(num_children > 0);
+	assert(num_children < PROC_CHILDREN);
+	for (m = 0; m < TPARALLEL_MAX; m++)
+		if (tpar[m].nth == 0)
+			break;
+	if (m == TPARALLEL_MAX) {
+		fprintf(stderr, "tparallel_begin: too many parallel regions\n");
 		exit(EXIT_FAILURE);
 	}
+	tp = &tpar[m];
+
+	for (cn = 0; cn < num_children; cn++)
+		if (pthread_create(&tp->th[cn], NULL, start_routine, args) != 0) {
+			fprintf(stderr, "tparallel_begin: thread creation failure: %d\n", errno);
+			exit(EXIT_FAILURE);
+		}
+	tp->nth = num_children;
+	tp->status = status_array;
+	*master = m + 1;
 }
 
 void
 tparallel_end(int master)
 {
-	int status;
-	int ret = pthread_join((pthread_t)master, (void **)&status);
-	if (ret != 0) {
-		fprintf(stderr, "tparallel_end: thread joining failure: %d\n", errno);
-		exit(EXIT_FAILURE);
-	}
-	if (status != EXIT_SUCCESS) {
-		fprintf(stderr, "tparallel_end: exit status %d\n", status);
-		exit(EXIT_FAILURE);
+	struct tparallel *tp = &tpar[master - 1];
+	void *status;
+	int cn;
+
+	assert(master > 0 && master <= TPARALLEL_MAX && tp->nth > 0);
+	for (cn = 0; cn < tp->nth; cn++) {
+		if (pthread_join(tp->th[cn], &status) != 0) {
+			fprintf(stderr, "tparallel_end: thread joining failure: %d\n", errno);
+			exit(EXIT_FAILURE);
+		}
+		tp->status[cn] = (intptr_t) status;
 	}
+	tp->nth = 0;
 }
 
 #endif // LAB >= 9
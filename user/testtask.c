@@ -0,0 +1,87 @@
+#if LAB >= 9
+// Test deterministic fork/join tasks
+
+#include <inc/stdio.h>
+#include <inc/string.h>
+#include <inc/assert.h>
+#include <inc/task.h>
+
+#define NOUTER	16		// outer tasks, each syncing its own group
+#define NINNER	32		// inner tasks per outer task
+#define NMANY	(TASK_MAX + 44)	// enough to make task_spawn() sync early
+
+int grid[NOUTER][NINNER];
+int many[NMANY];
+
+// Spend a while on some tasks and not others,
+// so that workers finish unevenly and must steal.
+static int
+work(int n)
+{
+	int i, x = n;
+	for (i = 0; i < (n % 7) * 10000; i++)
+		x = x * 1103515245 + 12345;
+	return x;
+}
+
+static void
+inner(void *arg)
+{
+	int *p = arg;
+	int n = p - &grid[0][0];
+	work(n);
+	*p = n * 3 + 1;
+}
+
+static void
+outer(void *arg)
+{
+	int *row = arg;
+	taskgroup g = { 0 };
+	int i;
+	for (i = 0; i < NINNER; i++)
+		task_spawn(&g, inner, &row[i]);
+	task_sync(&g);
+	for (i = 0; i < NINNER; i++)
+		assert(row[i] == (&row[i] - &grid[0][0]) * 3 + 1);
+}
+
+static void
+one(void *arg)
+{
+	int *p = arg;
+	*p = work(p - many);
+}
+
+int main(int argc, char **argv)
+{
+	taskgroup g = { 0 };
+	int i, j;
+
+	task_init(4);
+
+	// Nested groups, with uneven tasks
+	for (i = 0; i < NOUTER; i++)
+		task_spawn(&g, outer, grid[i]);
+	task_sync(&g);
+	for (i = 0; i < NOUTER; i++)
+		for (j = 0; j < NINNER; j++)
+			assert(grid[i][j] == (i * NINNER + j) * 3 + 1);
+	cprintf("testtask: nested groups OK\n");
+
+	// More tasks than a group holds at once
+	for (i = 0; i < NMANY; i++)
+		task_spawn(&g, one, &many[i]);
+	task_sync(&g);
+	for (i = 0; i < NMANY; i++)
+		assert(many[i] == work(i));
+	cprintf("testtask: large group OK\n");
+
+	// A sync with nothing to do
+	task_sync(&g);
+
+	cprintf("testtask: all tests passed\n");
+	return 0;
+}
+
+#endif	// LAB >= 9